@@ -0,0 +1,88 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <gnutls/abstract.h>
+#include "peer.h"
+
+// Compare key generation, signing and verification speed of the identity key types
+static double elapsed(struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-start->tv_sec)+(now.tv_nsec-start->tv_nsec)/1000000000.0;
+}
+
+static void bench(const char* name, gnutls_pk_algorithm_t pk, unsigned int bits)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  gnutls_x509_privkey_t x509key;
+  gnutls_x509_privkey_init(&x509key);
+  gnutls_x509_privkey_generate(x509key, pk, bits, 0);
+  double keygen=elapsed(&start);
+  gnutls_privkey_t privkey;
+  gnutls_privkey_init(&privkey);
+  gnutls_privkey_import_x509(privkey, x509key, 0);
+  gnutls_pubkey_t pubkey;
+  gnutls_pubkey_init(&pubkey);
+  gnutls_pubkey_import_privkey(pubkey, privkey, 0, 0);
+  gnutls_sign_algorithm_t algo=peer_signalgo(pk);
+  // Roughly the size of a short post update
+  unsigned char buf[256];
+  memset(buf, 'x', sizeof(buf));
+  gnutls_datum_t data={.data=buf, .size=sizeof(buf)};
+  gnutls_datum_t signature;
+  // Signing
+  unsigned int signs=0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while(elapsed(&start)<1)
+  {
+    gnutls_privkey_sign_data2(privkey, algo, 0, &data, &signature);
+    gnutls_free(signature.data);
+    ++signs;
+  }
+  double signtime=elapsed(&start);
+  // Verifying
+  gnutls_privkey_sign_data2(privkey, algo, 0, &data, &signature);
+  unsigned int verifies=0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while(elapsed(&start)<1)
+  {
+    if(gnutls_pubkey_verify_data2(pubkey, algo, 0, &data, &signature)<0){printf("%s: verification failed\n", name); break;}
+    ++verifies;
+  }
+  double verifytime=elapsed(&start);
+  printf("%-12s keygen %8.2fms, %8.0f signs/s, %8.0f verifies/s, %u byte signatures\n", name, keygen*1000, signs/signtime, verifies/verifytime, signature.size);
+  gnutls_free(signature.data);
+  gnutls_pubkey_deinit(pubkey);
+  gnutls_privkey_deinit(privkey);
+  gnutls_x509_privkey_deinit(x509key);
+}
+
+int main(void)
+{
+  gnutls_global_init();
+  bench("RSA-3072", GNUTLS_PK_RSA, 3072);
+  bench("ECDSA-P256", GNUTLS_PK_ECDSA, GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1));
+  bench("Ed25519", GNUTLS_PK_EDDSA_ED25519, 0);
+  gnutls_global_deinit();
+  return 0;
+}
@@ -0,0 +1,309 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "peer.h"
+#include "dht.h"
+#define LOOKUP_TIMEOUT 30
+#define MAX_LOOKUPS 32
+#define QUERY_NONE 0
+#define QUERY_CONNECTING 1
+#define QUERY_SENT 2
+
+struct contact
+{
+  unsigned char id[ID_SIZE];
+  struct sockaddr_storage addr;
+  uint16_t addrlen;
+  time_t timestamp;
+};
+
+struct bucket
+{
+  struct contact contacts[DHT_K]; // Least recently seen first
+  unsigned int count;
+};
+
+struct lookup
+{
+  unsigned char target[ID_SIZE];
+  struct contact shortlist[DHT_K]; // Closest first
+  uint8_t state[DHT_K];
+  unsigned int count;
+  time_t timestamp;
+};
+
+// Bucket n holds contacts whose IDs share exactly n leading bits with ours, allocated as needed
+static struct bucket* buckets[ID_SIZE*8];
+static struct lookup* lookups=0;
+static unsigned int lookupcount=0;
+static int dhtsocket=-1;
+
+int dht_distcmp(const unsigned char target[ID_SIZE], const unsigned char a[ID_SIZE], const unsigned char b[ID_SIZE])
+{
+  unsigned int i;
+  for(i=0; i<ID_SIZE; ++i)
+  {
+    unsigned char da=a[i]^target[i];
+    unsigned char db=b[i]^target[i];
+    if(da!=db){return (int)da-(int)db;}
+  }
+  return 0;
+}
+
+static unsigned int bucketindex(const unsigned char id[ID_SIZE])
+{
+  unsigned int i;
+  for(i=0; i<ID_SIZE; ++i)
+  {
+    unsigned char diff=id[i]^peer_id[i];
+    if(!diff){continue;}
+    unsigned int bit=0;
+    while(!(diff&0x80)){diff<<=1; ++bit;}
+    return i*8+bit;
+  }
+  return ID_SIZE*8-1;
+}
+
+static void update(const unsigned char id[ID_SIZE], struct sockaddr_storage* addr, uint16_t addrlen)
+{
+  if(!memcmp(id, peer_id, ID_SIZE) || !addrlen || addrlen>sizeof(struct sockaddr_storage)){return;}
+  unsigned int index=bucketindex(id);
+  if(!buckets[index]){buckets[index]=calloc(1, sizeof(struct bucket));}
+  struct bucket* bucket=buckets[index];
+  unsigned int i;
+  for(i=0; i<bucket->count; ++i)
+  {
+    if(!memcmp(bucket->contacts[i].id, id, ID_SIZE)){break;}
+  }
+  if(i==bucket->count)
+  {
+    if(bucket->count==DHT_K)
+    { // Full, only replace the least recently seen contact if it's no longer connected
+      if(peer_findbyid(bucket->contacts[0].id)){return;}
+      i=0;
+    }else{
+      ++bucket->count;
+    }
+  }
+  // Move it to the end as the most recently seen
+  memmove(&bucket->contacts[i], &bucket->contacts[i+1], sizeof(struct contact)*(bucket->count-i-1));
+  struct contact* contact=&bucket->contacts[bucket->count-1];
+  memcpy(contact->id, id, ID_SIZE);
+  memcpy(&contact->addr, addr, addrlen);
+  contact->addrlen=addrlen;
+  contact->timestamp=time(0);
+}
+
+// Get up to max contacts closest to target, closest first
+static unsigned int closest(const unsigned char target[ID_SIZE], struct contact* list, unsigned int max)
+{
+  unsigned int count=0;
+  unsigned int i;
+  for(i=0; i<ID_SIZE*8; ++i)
+  {
+    if(!buckets[i]){continue;}
+    unsigned int j;
+    for(j=0; j<buckets[i]->count; ++j)
+    {
+      struct contact* contact=&buckets[i]->contacts[j];
+      unsigned int pos=count;
+      while(pos>0 && dht_distcmp(target, contact->id, list[pos-1].id)<0){--pos;}
+      if(pos>=max){continue;}
+      if(count<max){++count;}
+      memmove(&list[pos+1], &list[pos], sizeof(struct contact)*(count-pos-1));
+      list[pos]=*contact;
+    }
+  }
+  return count;
+}
+
+static void lookup_add(struct lookup* lookup, struct contact* contact)
+{
+  unsigned int pos;
+  for(pos=0; pos<lookup->count; ++pos)
+  {
+    if(!memcmp(lookup->shortlist[pos].id, contact->id, ID_SIZE)){return;}
+  }
+  pos=lookup->count;
+  while(pos>0 && dht_distcmp(lookup->target, contact->id, lookup->shortlist[pos-1].id)<0){--pos;}
+  if(pos>=DHT_K){return;}
+  if(lookup->count<DHT_K){++lookup->count;}
+  unsigned int move=lookup->count-pos-1;
+  memmove(&lookup->shortlist[pos+1], &lookup->shortlist[pos], sizeof(struct contact)*move);
+  memmove(&lookup->state[pos+1], &lookup->state[pos], move);
+  lookup->shortlist[pos]=*contact;
+  lookup->state[pos]=QUERY_NONE;
+}
+
+static void lookup_remove(struct lookup* lookup)
+{
+  unsigned int i=lookup-lookups;
+  --lookupcount;
+  memmove(&lookups[i], &lookups[i+1], sizeof(struct lookup)*(lookupcount-i));
+}
+
+static struct lookup* lookup_find(const unsigned char target[ID_SIZE])
+{
+  time_t now=time(0);
+  unsigned int i;
+  for(i=0; i<lookupcount; ++i)
+  {
+    if(now-lookups[i].timestamp>LOOKUP_TIMEOUT){lookup_remove(&lookups[i]); --i; continue;}
+    if(!memcmp(lookups[i].target, target, ID_SIZE)){return &lookups[i];}
+  }
+  return 0;
+}
+
+// Query the next few unqueried contacts, connecting to them first if needed. Returns 0 once there is nothing left to query
+static char lookup_step(struct lookup* lookup)
+{
+  unsigned int i;
+  unsigned int queried=0;
+  char pending=0;
+  for(i=0; i<lookup->count && queried<DHT_ALPHA; ++i)
+  {
+    if(lookup->state[i]==QUERY_CONNECTING){pending=1;}
+    if(lookup->state[i]!=QUERY_NONE){continue;}
+    struct contact* contact=&lookup->shortlist[i];
+    struct peer* peer=peer_findbyid(contact->id);
+    if(peer && peer->handshake)
+    {
+      peer_sendcmd(peer, "findnode", lookup->target, ID_SIZE);
+      lookup->state[i]=QUERY_SENT;
+    }
+    else if(dhtsocket>=0)
+    { // Query it once connected, see dht_addpeer()
+      peer_new_unique(dhtsocket, &contact->addr, contact->addrlen);
+      lookup->state[i]=QUERY_CONNECTING;
+      pending=1;
+    }else{continue;}
+    ++queried;
+  }
+  return queried || pending;
+}
+
+static void findnode(struct peer* peer, void* data, unsigned int len)
+{
+  // <target ID, 32>
+  if(len!=ID_SIZE){return;}
+  struct contact list[DHT_K+1];
+  unsigned int count=closest(data, list, DHT_K+1);
+  // <target ID, 32>[<ID, 32><addrlen, 2><addr>]...
+  unsigned char reply[ID_SIZE+(DHT_K+1)*(sizeof(struct contact))];
+  unsigned int replylen=ID_SIZE;
+  memcpy(reply, data, ID_SIZE);
+  unsigned int i;
+  unsigned int sent=0;
+  for(i=0; i<count && sent<DHT_K; ++i)
+  {
+    if(!memcmp(list[i].id, peer->id, ID_SIZE)){continue;} // They know about themselves
+    memcpy(&reply[replylen], list[i].id, ID_SIZE);
+    replylen+=ID_SIZE;
+    memcpy(&reply[replylen], &list[i].addrlen, sizeof(list[i].addrlen));
+    replylen+=sizeof(list[i].addrlen);
+    memcpy(&reply[replylen], &list[i].addr, list[i].addrlen);
+    replylen+=list[i].addrlen;
+    ++sent;
+  }
+  peer_sendcmd(peer, "nodes", reply, replylen);
+}
+
+static void nodes(struct peer* peer, void* data, unsigned int len)
+{
+  if(len<ID_SIZE){return;}
+  unsigned char* target=data;
+  struct lookup* lookup=lookup_find(target);
+  // Contacts only go into our buckets once we've completed a handshake with them (dht_addpeer()), unsolicited replies are ignored
+  if(!lookup){return;}
+  char found=0;
+  unsigned int pos=ID_SIZE;
+  while(pos<len)
+  {
+    struct contact contact;
+    if(len<pos+ID_SIZE+sizeof(contact.addrlen)){return;}
+    memcpy(contact.id, data+pos, ID_SIZE);
+    pos+=ID_SIZE;
+    memcpy(&contact.addrlen, data+pos, sizeof(contact.addrlen));
+    pos+=sizeof(contact.addrlen);
+    if(!contact.addrlen || contact.addrlen>sizeof(contact.addr) || len<pos+contact.addrlen){return;}
+    memcpy(&contact.addr, data+pos, contact.addrlen);
+    pos+=contact.addrlen;
+    if(!memcmp(contact.id, peer_id, ID_SIZE)){continue;}
+    if(!memcmp(contact.id, target, ID_SIZE)){found=1;}
+    lookup_add(lookup, &contact);
+  }
+  if(found && !peer_findbyid(target))
+  { // The responder knows the target, have them pass on a findpeer so it connects back to us through any NAT while we connect to it
+    uint16_t ttl=2;
+    unsigned char request[ID_SIZE+sizeof(ttl)];
+    memcpy(request, target, ID_SIZE);
+    memcpy(request+ID_SIZE, &ttl, sizeof(ttl));
+    peer_sendcmd(peer, "findpeer", request, sizeof(request));
+  }
+  if(!lookup_step(lookup)){lookup_remove(lookup);}
+}
+
+void dht_init(void)
+{
+  peer_registercmd("findnode", findnode);
+  peer_registercmd("nodes", nodes);
+}
+
+void dht_addpeer(struct peer* peer)
+{
+  dhtsocket=udpstream_getsocket(peer->stream);
+  update(peer->id, &peer->addr, peer->addrlen);
+  unsigned int i;
+  for(i=0; i<lookupcount; ++i)
+  {
+    if(!memcmp(lookups[i].target, peer->id, ID_SIZE))
+    { // Found what we were looking for
+      lookup_remove(&lookups[i]);
+      --i;
+      continue;
+    }
+    unsigned int j;
+    for(j=0; j<lookups[i].count; ++j)
+    {
+      if(lookups[i].state[j]==QUERY_CONNECTING && !memcmp(lookups[i].shortlist[j].id, peer->id, ID_SIZE))
+      {
+        peer_sendcmd(peer, "findnode", lookups[i].target, ID_SIZE);
+        lookups[i].state[j]=QUERY_SENT;
+      }
+    }
+  }
+}
+
+void dht_lookup(const unsigned char target[ID_SIZE])
+{
+  if(!memcmp(target, peer_id, ID_SIZE) || peer_findbyid(target)){return;}
+  struct lookup* lookup=lookup_find(target);
+  if(!lookup)
+  {
+    if(lookupcount>=MAX_LOOKUPS){lookup_remove(&lookups[0]);} // Drop the oldest
+    ++lookupcount;
+    lookups=realloc(lookups, sizeof(struct lookup)*lookupcount);
+    lookup=&lookups[lookupcount-1];
+    memcpy(lookup->target, target, ID_SIZE);
+    lookup->count=closest(target, lookup->shortlist, DHT_K);
+    memset(lookup->state, QUERY_NONE, sizeof(lookup->state));
+  }
+  lookup->timestamp=time(0);
+  if(!lookup_step(lookup)){lookup_remove(lookup);}
+}
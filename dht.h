@@ -0,0 +1,61 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+* SECTION:dht
+* @title: DHT
+* @short_description: Routing towards peer IDs
+*
+* Kademlia-style routing table of peer IDs and addresses, bucketed by XOR distance from our own ID, used to find peers in a logarithmic number of hops
+*/
+#ifndef DHT_H
+#define DHT_H
+#include "peer.h"
+/**
+* DHT_K:
+*
+* Number of contacts kept per bucket, and returned by each lookup step
+*/
+#define DHT_K 8
+/**
+* DHT_ALPHA:
+*
+* Number of contacts queried in parallel during a lookup
+*/
+#define DHT_ALPHA 3
+
+// Registers the DHT commands, called by peer_init()
+extern void dht_init(void);
+// Add a peer to the routing table once its handshake completes, called by peer_handlesocket()
+extern void dht_addpeer(struct peer* peer);
+/**
+* dht_distcmp:
+* @target: ID to measure distance from
+* @a: First ID
+* @b: Second ID
+*
+* Compare the XOR distances of two IDs to a target
+* Returns: Less than, equal to, or greater than zero if @a is closer to, as close as, or further from @target than @b
+*/
+extern int dht_distcmp(const unsigned char target[ID_SIZE], const unsigned char a[ID_SIZE], const unsigned char b[ID_SIZE]);
+/**
+* dht_lookup:
+* @target: Peer ID
+*
+* Start an iterative lookup, repeatedly asking the closest known peers for peers even closer to @target, and connect to it once found
+*/
+extern void dht_lookup(const unsigned char target[ID_SIZE]);
+#endif
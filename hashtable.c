@@ -0,0 +1,136 @@
+/*
+    Socialnetwork, a truly peer-to-peer social network (in search of a better name)
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+
+struct hashitem
+{
+  struct hashitem* next;
+  uint32_t hash;
+  void* value;
+  unsigned int keylen;
+  unsigned char key[];
+};
+
+static uint32_t hash(const unsigned char* key, unsigned int keylen)
+{
+  // FNV-1a
+  uint32_t hash=2166136261;
+  unsigned int i;
+  for(i=0; i<keylen; ++i)
+  {
+    hash^=key[i];
+    hash*=16777619;
+  }
+  return hash;
+}
+
+static struct hashitem** finditem(struct hashtable* table, uint32_t hash, const void* key, unsigned int keylen)
+{
+  struct hashitem** item=&table->buckets[hash&(table->bucketcount-1)];
+  while(*item)
+  {
+    if((*item)->hash==hash && (*item)->keylen==keylen && !memcmp((*item)->key, key, keylen)){break;}
+    item=&(*item)->next;
+  }
+  return item;
+}
+
+static void grow(struct hashtable* table)
+{
+  unsigned int oldcount=table->bucketcount;
+  struct hashitem** old=table->buckets;
+  table->bucketcount=(oldcount?oldcount*2:16);
+  table->buckets=calloc(table->bucketcount, sizeof(void*));
+  unsigned int i;
+  for(i=0; i<oldcount; ++i)
+  {
+    while(old[i])
+    {
+      struct hashitem* item=old[i];
+      old[i]=item->next;
+      struct hashitem** bucket=&table->buckets[item->hash&(table->bucketcount-1)];
+      item->next=*bucket;
+      *bucket=item;
+    }
+  }
+  free(old);
+}
+
+void hashtable_init(struct hashtable* table)
+{
+  table->buckets=0;
+  table->bucketcount=0;
+  table->count=0;
+}
+
+void* hashtable_get(struct hashtable* table, const void* key, unsigned int keylen)
+{
+  if(!table->count){return 0;}
+  struct hashitem* item=*finditem(table, hash(key, keylen), key, keylen);
+  return item?item->value:0;
+}
+
+void hashtable_set(struct hashtable* table, const void* key, unsigned int keylen, void* value)
+{
+  if(table->count>=table->bucketcount){grow(table);} // Keep chains short
+  uint32_t h=hash(key, keylen);
+  struct hashitem** item=finditem(table, h, key, keylen);
+  if(*item){(*item)->value=value; return;}
+  *item=malloc(sizeof(struct hashitem)+keylen);
+  (*item)->next=0;
+  (*item)->hash=h;
+  (*item)->value=value;
+  (*item)->keylen=keylen;
+  memcpy((*item)->key, key, keylen);
+  ++table->count;
+}
+
+void hashtable_remove(struct hashtable* table, const void* key, unsigned int keylen)
+{
+  if(!table->count){return;}
+  struct hashitem** item=finditem(table, hash(key, keylen), key, keylen);
+  if(!*item){return;}
+  struct hashitem* next=(*item)->next;
+  free(*item);
+  *item=next;
+  --table->count;
+}
+
+void hashtable_clear(struct hashtable* table)
+{
+  unsigned int i;
+  for(i=0; i<table->bucketcount; ++i)
+  {
+    while(table->buckets[i])
+    {
+      struct hashitem* next=table->buckets[i]->next;
+      free(table->buckets[i]);
+      table->buckets[i]=next;
+    }
+  }
+  table->count=0;
+}
+
+void hashtable_deinit(struct hashtable* table)
+{
+  hashtable_clear(table);
+  free(table->buckets);
+  hashtable_init(table);
+}
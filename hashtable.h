@@ -0,0 +1,68 @@
+/*
+    Socialnetwork, a truly peer-to-peer social network (in search of a better name)
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+* SECTION:hashtable
+* @title: Hash table
+* @short_description: Lookup tables keyed on binary data
+*
+* Hash tables mapping binary keys (IDs, addresses etc.) to pointers
+*/
+#ifndef HASHTABLE_H
+#define HASHTABLE_H
+struct hashitem;
+
+/**
+* hashtable:
+* @buckets: Chains of items, indexed by hash
+* @bucketcount: Number of buckets, always a power of 2 (or 0 before the first item is added)
+* @count: Number of items in the table
+*
+* A hash table, initialize with hashtable_init()
+*/
+struct hashtable
+{
+  struct hashitem** buckets;
+  unsigned int bucketcount;
+  unsigned int count;
+};
+
+extern void hashtable_init(struct hashtable* table);
+/**
+* hashtable_get:
+* @table: Hash table
+* @key: Key data
+* @keylen: Length of key data
+*
+* Look up an item
+* Returns: The item's value, or NULL if there is no item with the given key
+*/
+extern void* hashtable_get(struct hashtable* table, const void* key, unsigned int keylen);
+/**
+* hashtable_set:
+* @table: Hash table
+* @key: Key data, copied into the table
+* @keylen: Length of key data
+* @value: Value to store for the key, replacing any previous value
+*
+* Add or replace an item
+*/
+extern void hashtable_set(struct hashtable* table, const void* key, unsigned int keylen, void* value);
+extern void hashtable_remove(struct hashtable* table, const void* key, unsigned int keylen);
+// Remove all items, keeping the table usable
+extern void hashtable_clear(struct hashtable* table);
+extern void hashtable_deinit(struct hashtable* table);
+#endif
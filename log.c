@@ -0,0 +1,34 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdarg.h>
+#include <stdio.h>
+#include "log.h"
+
+int log_level=LOGLEVEL_INFO;
+FILE* log_output=0;
+
+void log_write(int level, const char* fmt, ...)
+{
+  static const char* names[]={"error", "warning", "info", "debug"};
+  FILE* f=(log_output?log_output:stderr);
+  fprintf(f, "[%s] ", names[level]);
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(f, fmt, args);
+  va_end(args);
+  fputc('\n', f);
+}
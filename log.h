@@ -0,0 +1,60 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+* SECTION:log
+* @title: Logging
+* @short_description: Leveled log messages
+*
+* Log messages with a runtime log level, messages above the level cost a single comparison
+*/
+#ifndef LOG_H
+#define LOG_H
+#include <stdio.h>
+#define LOGLEVEL_ERROR 0
+#define LOGLEVEL_WARN  1
+#define LOGLEVEL_INFO  2
+#define LOGLEVEL_DEBUG 3
+/**
+* LOGLEVEL_MAX:
+*
+* Highest log level compiled in, define it to a lower level at build time to leave out more verbose messages entirely
+*/
+#ifndef LOGLEVEL_MAX
+#define LOGLEVEL_MAX LOGLEVEL_DEBUG
+#endif
+/**
+* LOG:
+* @level: Log level of the message, LOGLEVEL_ERROR, LOGLEVEL_WARN, LOGLEVEL_INFO or LOGLEVEL_DEBUG
+* @...: printf-style format string and arguments
+*
+* Log a message, the arguments are only evaluated if @level is enabled
+*/
+#define LOG(level, ...) do{if((level)<=LOGLEVEL_MAX && (level)<=log_level){log_write(level, __VA_ARGS__);}}while(0)
+/**
+* log_level:
+*
+* Current log level, messages with a higher level are skipped. Defaults to LOGLEVEL_INFO
+*/
+extern int log_level;
+/**
+* log_output:
+*
+* Where log messages are written, stderr if NULL
+*/
+extern FILE* log_output;
+extern void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+#endif
@@ -21,12 +21,42 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <zlib.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #include <gnutls/abstract.h>
+#include <gnutls/crypto.h>
 #include "udpstream.h"
+#include "hashtable.h"
 #include "peer.h"
+#include "dht.h"
+#include "peercache.h"
+#include "threadpool.h"
+#include "log.h"
 #define GOOD_NUMBER_OF_PEERS 20
+#define MAX_PEERS (GOOD_NUMBER_OF_PEERS*3/2)
+#define VIEW_SIZE 32
+#define SHUFFLE_LENGTH 8
+#define SHUFFLE_INTERVAL 10
+#define SAMPLE_MAXSIZE (sizeof(uint16_t)+SHUFFLE_LENGTH*(sizeof(uint16_t)*2+sizeof(struct sockaddr_storage)))
+#define CERT_LIFETIME 3600
+#define RESUME_CACHE_SIZE 256
+#define FINDPEER_BUCKETS 3
+#define FINDPEER_BUCKETTIME 10
+#define FINDPEER_BUCKETSIZE 4096
+#define MAX_HALFOPEN 64
+#define HALFOPEN_RESERVED 16 // Extra room for peers we've been connected to before
+#define ADMIT_RATE 2 // New handshakes per second per source prefix
+#define ADMIT_BURST 10
+#define ADMIT_PREFIXES 4096
+#define CMD_DEFLATED 0x80 // Set in the command name length when the payload is compressed
+#define DEFLATE_THRESHOLD 128
+#define MAX_INFLATED (16*1024*1024)
+#define MAX_UNACKED 8 // Packets in flight to a peer before we hold back more commands, low enough for a default-sized socket buffer to take them
+#define SEND_QUANTUM 16384 // Bytes each peer may send per scheduling round
+#define MAX_QUEUED (4*1024*1024) // Bytes held back for a peer before bulk (media) commands get dropped, others are expected to wait for the drain handler
+#define BOOTSTRAP_STAGGER 0.25 // Seconds before trying a bootstrap entry's next address
+#define BOOTSTRAP_TIMEOUT 10 // Seconds after trying an entry's last address before we stop waiting for one of them to get through
 
 struct command
 {
@@ -34,104 +64,329 @@ struct command
   void(*callback)(struct peer*,void*,unsigned int);
 };
 
+struct queuedcmd
+{
+  struct queuedcmd* next;
+  unsigned int len;
+  unsigned char data[]; // <command name length, 1><command name><data length, 4><data>
+};
+
+struct cmdstats
+{
+  char* name;
+  struct peer_cmdstats stats;
+};
+
+struct credentials
+{
+  gnutls_certificate_credentials_t cred;
+  time_t timestamp;
+  unsigned int refcount;
+};
+
+struct resumedata
+{
+  unsigned char id[ID_SIZE];
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  gnutls_datum_t data;
+};
+
 unsigned char peer_id[ID_SIZE];
 gnutls_privkey_t peer_privkey=0;
+struct peerstats peer_stats={0};
 static struct peer** peers=0;
 static unsigned int peercount=0;
+static struct hashtable peersbyid; // Only peers which completed the handshake
+static struct hashtable peersbyaddr;
 static struct command* commands=0;
 static unsigned int commandcount=0;
+static struct cmdstats** cmdstats=0;
+static unsigned int cmdstatscount=0;
+static struct hashtable cmdstatsbyname;
 static gnutls_x509_privkey_t privkey=0;
+static gnutls_datum_t ticketkey={0};
+static struct resumedata* resumedata=0;
+static unsigned int resumecount=0;
+static unsigned char* dictionary=0;
+static unsigned int dictionarylen=0;
+static uint32_t dictionaryid=0;
+static uint32_t ourcaps=PEER_CAP_DEFLATE;
+static unsigned int nextsender=0;
+static void(*drainhandler)(struct peer*)=0;
+// Outgoing bandwidth limits in bytes per second, 0 for unlimited, with bursts of up to a second's worth
+static uint32_t peerrate=0;
+static uint32_t totalrate=0;
+static double totaltokens=0;
+static double totaltimestamp=0;
+
+static struct peer_cmdstats* getcmdstats(const char* name, char create)
+{
+  unsigned int len=strlen(name);
+  struct cmdstats* entry=hashtable_get(&cmdstatsbyname, name, len);
+  if(!entry)
+  {
+    if(!create){return 0;}
+    entry=calloc(1, sizeof(struct cmdstats));
+    entry->name=strdup(name);
+    ++cmdstatscount;
+    cmdstats=realloc(cmdstats, sizeof(void*)*cmdstatscount);
+    cmdstats[cmdstatscount-1]=entry;
+    hashtable_set(&cmdstatsbyname, name, len, entry);
+  }
+  return &entry->stats;
+}
+
+static double monotime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+// Add tokens to a bucket for the time that passed, up to burst
+static void refill(double* tokens, double* timestamp, double rate, double burst, double now)
+{
+  *tokens+=(now-*timestamp)*rate;
+  if(*tokens>burst){*tokens=burst;}
+  *timestamp=now;
+}
 
 void peer_registercmd(const char* name, void(*callback)(struct peer*,void*,unsigned int))
 {
+  getcmdstats(name, 1); // Only keep stats for commands we handle, so peers can't make us track arbitrary names
   ++commandcount;
   commands=realloc(commands, sizeof(struct command)*commandcount);
   commands[commandcount-1].name=strdup(name);
   commands[commandcount-1].callback=callback;
 }
 
-static void sendpeers(struct peer* peer, void* x, unsigned int len)
+// Partial view of the network (Cyclon-style), peers we're not connected to but could connect to. Exchanged in small random samples so it stays fresh without ever sending whole peer lists
+struct peeritem
 {
-  len=0;
-  uint16_t addrlen; // 64kb should be enough for addresses for a while, right?
-  uint16_t pcount;
+  uint16_t addrlen;
+  struct sockaddr_storage addr;
+  uint16_t age; // Shuffle rounds since it was last known to be alive
+};
+static struct peeritem view[VIEW_SIZE];
+static unsigned int viewcount=0;
+static time_t shuffletime=0;
+
+static void view_add(struct sockaddr_storage* addr, uint16_t addrlen, uint16_t age)
+{
+  if(!addrlen || addrlen>sizeof(struct sockaddr_storage)){return;}
+  if(hashtable_get(&peersbyaddr, addr, addrlen)){return;} // Already connected
   unsigned int i;
-  for(i=0; i<peercount; ++i)
+  unsigned int oldest=0;
+  for(i=0; i<viewcount; ++i)
   {
-    if(!peers[i]->handshake){continue;} // Don't share incomplete/broken peers
-    len+=sizeof(addrlen)+peers[i]->addrlen+sizeof(pcount);
+    if(view[i].addrlen==addrlen && !memcmp(&view[i].addr, addr, addrlen))
+    {
+      if(age<view[i].age){view[i].age=age;}
+      return;
+    }
+    if(view[i].age>view[oldest].age){oldest=i;}
   }
-  char data[len];
-  x=data;
+  if(viewcount<VIEW_SIZE){i=viewcount++;}
+  else if(view[oldest].age>age){i=oldest;}
+  else{return;}
+  view[i].addrlen=addrlen;
+  memcpy(&view[i].addr, addr, addrlen);
+  view[i].age=age;
+}
+
+// Compose <our peer count, 2>[<addrlen, 2><addr><age, 2>]... with up to SHUFFLE_LENGTH random entries from our connections and view
+static unsigned int peers_sample(struct peer* recipient, unsigned char* data)
+{
+  // +1 since zero-length arrays aren't allowed, when we have no peers or view yet
+  struct peeritem* candidates[peercount+viewcount+1];
+  struct peeritem connected[peercount+1];
+  unsigned int count=0;
+  unsigned int i;
   for(i=0; i<peercount; ++i)
   {
-    if(!peers[i]->handshake){continue;} // Don't share incomplete/broken peers
-    addrlen=peers[i]->addrlen;
-    memcpy(x, &addrlen, sizeof(addrlen));
-    x+=sizeof(addrlen);
-    memcpy(x, &peers[i]->addr, addrlen);
-    x+=addrlen;
-    pcount=peers[i]->peercount;
-    memcpy(x, &pcount, sizeof(pcount));
-    x+=sizeof(pcount);
+    if(!peers[i]->handshake || peers[i]==recipient){continue;} // Don't share incomplete/broken peers
+    connected[i].addrlen=peers[i]->addrlen;
+    memcpy(&connected[i].addr, &peers[i]->addr, peers[i]->addrlen);
+    connected[i].age=0;
+    candidates[count++]=&connected[i];
+  }
+  for(i=0; i<viewcount; ++i){candidates[count++]=&view[i];}
+  uint16_t pcount=peercount;
+  memcpy(data, &pcount, sizeof(pcount));
+  unsigned int len=sizeof(pcount);
+  for(i=0; i<count && i<SHUFFLE_LENGTH; ++i)
+  {
+    // Partial Fisher-Yates shuffle
+    uint32_t r;
+    gnutls_rnd(GNUTLS_RND_NONCE, &r, sizeof(r));
+    unsigned int pick=i+r%(count-i);
+    struct peeritem* item=candidates[pick];
+    candidates[pick]=candidates[i];
+    memcpy(&data[len], &item->addrlen, sizeof(item->addrlen));
+    len+=sizeof(item->addrlen);
+    memcpy(&data[len], &item->addr, item->addrlen);
+    len+=item->addrlen;
+    memcpy(&data[len], &item->age, sizeof(item->age));
+    len+=sizeof(item->age);
   }
-  peer_sendcmd(peer, "peers", data, len);
+  return len;
 }
 
-struct peeritem
+static void peers_merge(struct peer* peer, unsigned char* data, unsigned int len)
 {
+  uint16_t pcount;
+  if(len<sizeof(pcount)){return;}
+  memcpy(&pcount, data, sizeof(pcount));
+  peer->peercount=pcount;
+  unsigned int pos=sizeof(pcount);
   uint16_t addrlen;
-  struct sockaddr_storage addr;
-  uint16_t peercount;
-};
+  uint16_t age;
+  while(len>=pos+sizeof(addrlen))
+  {
+    memcpy(&addrlen, &data[pos], sizeof(addrlen));
+    pos+=sizeof(addrlen);
+    if(addrlen>sizeof(struct sockaddr_storage) || len<pos+addrlen+sizeof(age)){break;}
+    struct sockaddr_storage addr;
+    memcpy(&addr, &data[pos], addrlen);
+    pos+=addrlen;
+    memcpy(&age, &data[pos], sizeof(age));
+    pos+=sizeof(age);
+    view_add(&addr, addrlen, age);
+  }
+}
+
+// Connect to the freshest entries in our view until we have enough peers
+static void peers_fill(int sock)
+{
+  while(viewcount && peercount<GOOD_NUMBER_OF_PEERS)
+  {
+    unsigned int youngest=0;
+    unsigned int i;
+    for(i=1; i<viewcount; ++i)
+    {
+      if(view[i].age<view[youngest].age){youngest=i;}
+    }
+    struct peeritem item=view[youngest];
+    view[youngest]=view[--viewcount];
+    peer_new_unique(sock, &item.addr, item.addrlen);
+  }
+}
+
+static void sendpeers(struct peer* peer, void* x, unsigned int len)
+{
+  (void)x; (void)len;
+  unsigned char data[SAMPLE_MAXSIZE];
+  peer_sendcmd(peer, "peers", data, peers_sample(peer, data));
+}
+
 static void getpeers(struct peer* peer, void* data, unsigned int len)
 {
-  // Receiving list of peer's peers
-  uint16_t addrlen;
-  struct peeritem* peers=0;
-  unsigned int pcount=0;
-  // Compose a temporary list and then pick the lowest peer-counts until we have GOOD_NUMBER_OF_PEERS peers (or we exhausted the list)
-  while(len>sizeof(addrlen))
-  {
-    memcpy(&addrlen, data, sizeof(addrlen));
-    if(len<sizeof(addrlen)+addrlen+sizeof(pcount)){break;}
-    if(addrlen<=sizeof(struct sockaddr_storage))
+  // Receiving a sample of peer's peers
+  peers_merge(peer, data, len);
+  peers_fill(udpstream_getsocket(peer->stream));
+  LOG(LOGLEVEL_DEBUG, "We now have %u peers", peercount);
+}
+
+static void shuffle(struct peer* peer, void* data, unsigned int len)
+{
+  // Reply with a sample of our own before merging theirs so we don't just send it back
+  unsigned char reply[SAMPLE_MAXSIZE];
+  peer_sendcmd(peer, "peers", reply, peers_sample(peer, reply));
+  peers_merge(peer, data, len);
+}
+
+// Periodically age our view, shuffle part of it with a random peer, and keep the number of connections in check
+static void peers_maintain(int sock)
+{
+  time_t now=time(0);
+  if(now-shuffletime<SHUFFLE_INTERVAL){return;}
+  shuffletime=now;
+  unsigned int i;
+  for(i=0; i<viewcount; ++i){if(view[i].age<UINT16_MAX){++view[i].age;}}
+  unsigned int connected=0;
+  for(i=0; i<peercount; ++i){connected+=!!peers[i]->handshake;}
+  if(connected)
+  {
+    uint32_t r;
+    gnutls_rnd(GNUTLS_RND_NONCE, &r, sizeof(r));
+    r%=connected;
+    for(i=0; i<peercount; ++i)
     {
-      ++pcount;
-      peers=realloc(peers, sizeof(struct peeritem)*pcount);
-      peers[pcount-1].addrlen=addrlen;
-      memcpy(&peers[pcount-1].addr, data+sizeof(addrlen), addrlen);
-      memcpy(&peers[pcount-1].peercount, data+sizeof(addrlen)+addrlen, sizeof(uint16_t));
+      if(!peers[i]->handshake){continue;}
+      if(!r)
+      {
+        unsigned char data[SAMPLE_MAXSIZE];
+        peer_sendcmd(peers[i], "shuffle", data, peers_sample(peers[i], data));
+        break;
+      }
+      --r;
     }
-    data+=sizeof(addrlen)+addrlen+sizeof(uint16_t);
-    len-=sizeof(addrlen)+addrlen+sizeof(uint16_t);
   }
-  peer->peercount=pcount;
-  int sock=udpstream_getsocket(peer->stream);
-  while(pcount && peercount<GOOD_NUMBER_OF_PEERS)
+  // Drop the most connected peers first, they'll be fine without us
+  while(peercount>MAX_PEERS)
   {
-// TODO: Ditch current peers with higher peer counts if we have more than necessary
-    unsigned int lowest=0;
-    unsigned int i;
-    for(i=1; i<pcount; ++i)
+    struct peer* evict=0;
+    for(i=0; i<peercount; ++i)
     {
-      if(peers[i].peercount<peers[lowest].peercount){lowest=i;}
+      if(!peers[i]->handshake || peers[i]->keep){continue;}
+      if(!evict || peers[i]->peercount>evict->peercount){evict=peers[i];}
     }
-    peer_new_unique(sock, &peers[lowest].addr, peers[lowest].addrlen);
-    --pcount;
-    memmove(&peers[lowest], &peers[lowest+1], sizeof(struct peeritem)*(pcount-lowest));
+    if(!evict){break;}
+    ++peer_stats.evictedpeers;
+    peer_disconnect(evict, 1);
   }
-  free(peers);
-printf("We now have %u peers\n", peercount);
+  peers_fill(sock);
+  peercache_maintain();
 }
 
-struct findpeer_request
+// Remember handled findpeer requests in a few hash tables covering FINDPEER_BUCKETTIME seconds each, dropping the oldest table as time passes or the newest fills up
+static struct hashtable findpeer_handled[FINDPEER_BUCKETS];
+static unsigned int findpeer_current=0;
+static time_t findpeer_timestamp=0;
+static char findpeer_seen(const unsigned char id[ID_SIZE], struct sockaddr_storage* addr, uint16_t addrlen)
 {
-  unsigned char id[ID_SIZE];
-  struct sockaddr_storage addr;
-  uint16_t addrlen;
-  time_t timestamp;
-};
+  unsigned char key[ID_SIZE+addrlen];
+  memcpy(key, id, ID_SIZE);
+  memcpy(key+ID_SIZE, addr, addrlen);
+  time_t now=time(0);
+  unsigned int expired=(now-findpeer_timestamp)/FINDPEER_BUCKETTIME;
+  if(!expired && findpeer_handled[findpeer_current].count>=FINDPEER_BUCKETSIZE){expired=1;}
+  if(expired>FINDPEER_BUCKETS){expired=FINDPEER_BUCKETS;}
+  if(expired){findpeer_timestamp=now;}
+  while(expired)
+  {
+    findpeer_current=(findpeer_current+1)%FINDPEER_BUCKETS;
+    hashtable_clear(&findpeer_handled[findpeer_current]);
+    --expired;
+  }
+  unsigned int i;
+  for(i=0; i<FINDPEER_BUCKETS; ++i)
+  {
+    if(hashtable_get(&findpeer_handled[i], key, sizeof(key)))
+    { // Already handled, move it to the current bucket too in case it keeps coming for a while
+      hashtable_set(&findpeer_handled[findpeer_current], key, sizeof(key), findpeer_handled);
+      return 1;
+    }
+  }
+  hashtable_set(&findpeer_handled[findpeer_current], key, sizeof(key), findpeer_handled);
+  return 0;
+}
+
+// Get the connected peer closest to the target, optionally only if it's closer than we are
+static struct peer* closestpeer(const unsigned char target[ID_SIZE], struct peer* exclude, char closerthanus)
+{
+  struct peer* best=0;
+  unsigned int i;
+  for(i=0; i<peercount; ++i)
+  {
+    if(!peers[i]->handshake || peers[i]==exclude){continue;}
+    if(closerthanus && dht_distcmp(target, peers[i]->id, peer_id)>=0){continue;}
+    if(!best || dht_distcmp(target, peers[i]->id, best->id)<0){best=peers[i];}
+  }
+  return best;
+}
+
 static void findpeer(struct peer* peer, void* data, unsigned int len)
 {
   // <target ID, 32><ttl, 2>[<addrlen, 2><source addr>]
@@ -140,7 +395,7 @@ static void findpeer(struct peer* peer, void* data, unsigned int len)
   if(len<ID_SIZE+sizeof(ttl)){return;}
   unsigned char id[ID_SIZE];
   memcpy(id, data, ID_SIZE);
-printf("Got findpeer request for '"PEERFMT"'\n", PEERARG(id));
+  LOG(LOGLEVEL_DEBUG, "Got findpeer request for '"PEERFMT"'", PEERARG(id));
   memcpy(&ttl, data+ID_SIZE, sizeof(ttl));
   if(!ttl){return;}
   --ttl;
@@ -149,7 +404,7 @@ printf("Got findpeer request for '"PEERFMT"'\n", PEERARG(id));
   if(len>ID_SIZE+sizeof(ttl)+sizeof(addrlen))
   { // Has address already
     memcpy(&addrlen, data+ID_SIZE+sizeof(ttl), sizeof(addrlen));
-    if(len<ID_SIZE+sizeof(ttl)+sizeof(addrlen)+addrlen){return;}
+    if(addrlen>sizeof(addr) || len<ID_SIZE+sizeof(ttl)+sizeof(addrlen)+addrlen){return;}
     memcpy(&addr, data+ID_SIZE+sizeof(ttl)+sizeof(addrlen), addrlen);
   }
   else if(len==ID_SIZE+sizeof(ttl))
@@ -158,41 +413,20 @@ printf("Got findpeer request for '"PEERFMT"'\n", PEERARG(id));
     memcpy(&addr, &peer->addr, addrlen);
   }else{return;}
   // Avoid floody loops by keeping track of what we've already handled recently
-  static struct findpeer_request* reqs=0;
-  static unsigned int reqcount=0;
-  time_t now=time(0);
-  struct findpeer_request* newentry=0;
-  unsigned int i;
-  for(i=0; i<reqcount; ++i)
+  if(findpeer_seen(id, &addr, addrlen))
   {
-    if(reqs[i].timestamp+30<now) // Old entry (30 seconds)
-    {
-      newentry=&reqs[i]; // Mark as replacable
-    }
-    else if(!memcmp(reqs[i].id, id, ID_SIZE) && reqs[i].addrlen==addrlen && !memcmp(&reqs[i].addr, &addr, addrlen))
-    { // Already handled, update the timestamp too in case it keeps coming for a while
-      reqs[i].timestamp=now;
-      return;
-    }
-  }
-  if(!newentry) // Make room for new entry if there were no old ones to replace
-  {
-    ++reqcount;
-    reqs=realloc(reqs, sizeof(struct findpeer_request)*reqcount);
-    newentry=&reqs[reqcount-1];
+    ++peer_stats.findpeersuppressed;
+    return;
   }
-  memcpy(newentry->id, id, ID_SIZE);
-  memcpy(&newentry->addr, &addr, addrlen);
-  newentry->addrlen=addrlen;
-  newentry->timestamp=now;
   // Check if it's us
   if(!memcmp(id, peer_id, ID_SIZE))
   {
     peer_new_unique(udpstream_getsocket(peer->stream), &addr, addrlen);
     return;
   }
-  // Propagate (unless it was us, !ttl, or already handled)
-  if(ttl)
+  // Pass it on to whichever peer is closest to the target, as long as that gets it closer (unless it was us, !ttl, or already handled)
+  struct peer* next=(ttl?closestpeer(id, peer, 1):0);
+  if(next)
   {
     len=ID_SIZE+sizeof(ttl)+sizeof(addrlen)+addrlen;
     unsigned char data[len];
@@ -200,10 +434,45 @@ printf("Got findpeer request for '"PEERFMT"'\n", PEERARG(id));
     memcpy(data+ID_SIZE, &ttl, sizeof(ttl));
     memcpy(data+ID_SIZE+sizeof(ttl), &addrlen, sizeof(addrlen));
     memcpy(data+ID_SIZE+sizeof(ttl)+sizeof(addrlen), &addr, addrlen);
-    peer_sendcmd(0, "findpeer", data, len);
+    peer_sendcmd(next, "findpeer", data, len);
+    ++peer_stats.findpeerforwarded;
   }
 }
 
+static void sendcaps(struct peer* peer)
+{
+  // <capabilities, 4><dictionary ID, 4>
+  unsigned char data[sizeof(ourcaps)+sizeof(dictionaryid)];
+  memcpy(data, &ourcaps, sizeof(ourcaps));
+  memcpy(data+sizeof(ourcaps), &dictionaryid, sizeof(dictionaryid));
+  peer_sendcmd(peer, "caps", data, sizeof(data));
+}
+
+static void caps(struct peer* peer, void* data, unsigned int len)
+{
+  // Allow longer payloads so more can be added later
+  if(len<sizeof(peer->caps)+sizeof(peer->dictionary)){return;}
+  memcpy(&peer->caps, data, sizeof(peer->caps));
+  memcpy(&peer->dictionary, data+sizeof(peer->caps), sizeof(peer->dictionary));
+}
+
+void peer_setdictionary(const void* data, unsigned int len)
+{
+  free(dictionary);
+  dictionary=malloc(len);
+  memcpy(dictionary, data, len);
+  dictionarylen=len;
+  dictionaryid=crc32(0, dictionary, len);
+  if(!dictionaryid){dictionaryid=1;} // 0 means no dictionary
+  sendcaps(0); // Let peers we're already connected to know
+}
+
+void peer_addcaps(uint32_t caps)
+{
+  ourcaps|=caps;
+  sendcaps(0);
+}
+
 void peer_init(const char* keypath)
 {
   gnutls_global_init();
@@ -228,12 +497,13 @@ void peer_init(const char* keypath)
     if(loadfailed)
     {
 // printf("Generating a new key...\n");
-      // TODO: Why do handshakes fail with >3072 bit keys?
-      gnutls_x509_privkey_generate(privkey, GNUTLS_PK_RSA, 3072, 0);
+      // Ed25519 keys are quick to generate and make handshakes and update signatures far cheaper than RSA, older RSA keys still load fine
+      gnutls_x509_privkey_generate(privkey, GNUTLS_PK_EDDSA_ED25519, 0, 0);
 // printf("Done\n");
-      // TODO: Allow exporting encrypted key, using _export2_pkcs8() I think
+      // TODO: Allow exporting encrypted key, by passing a password here
+      // Note: PKCS#8 is the only PEM format that can be imported again for Ed25519 keys
       gnutls_datum_t keydata;
-      gnutls_x509_privkey_export2(privkey, GNUTLS_X509_FMT_PEM, &keydata);
+      gnutls_x509_privkey_export2_pkcs8(privkey, GNUTLS_X509_FMT_PEM, 0, GNUTLS_PKCS_PLAIN, &keydata);
       int f=open(keypath, O_WRONLY|O_TRUNC|O_CREAT, 0600);
       write(f, keydata.data, keydata.size);
       close(f);
@@ -243,29 +513,35 @@ void peer_init(const char* keypath)
     gnutls_x509_privkey_get_key_id(privkey, GNUTLS_KEYID_USE_SHA256, peer_id, &size);
     gnutls_privkey_init(&peer_privkey);
     gnutls_privkey_import_x509(peer_privkey, privkey, 0);
+    // Key for encrypting session tickets, so reconnecting peers can resume without redoing the public key operations
+    gnutls_session_ticket_key_generate(&ticketkey);
   }
   // Register core commands
   peer_registercmd("getpeers", sendpeers);
   peer_registercmd("peers", getpeers);
+  peer_registercmd("shuffle", shuffle);
   peer_registercmd("findpeer", findpeer);
+  peer_registercmd("caps", caps);
+  dht_init();
 }
 
-static int checkcert(gnutls_session_t tls)
+gnutls_sign_algorithm_t peer_signalgo(gnutls_pk_algorithm_t pk)
 {
-  // Find which peer the session belongs to
-  struct peer* peer=0;
-  unsigned int i;
-  for(i=0; i<peercount; ++i)
+  switch(pk)
   {
-    if(peers[i]->tls==tls){peer=peers[i]; break;}
+  case GNUTLS_PK_EDDSA_ED25519: return GNUTLS_SIGN_EDDSA_ED25519;
+  case GNUTLS_PK_ECDSA: return GNUTLS_SIGN_ECDSA_SHA256;
+  default: return GNUTLS_SIGN_RSA_SHA256;
   }
-  if(!peer){return 1;}
+}
 
+static char readcert(struct peer* peer)
+{
   // Get its certificate
   unsigned int count;
-  const gnutls_datum_t* certs=gnutls_certificate_get_peers(tls, &count);
+  const gnutls_datum_t* certs=gnutls_certificate_get_peers(peer->tls, &count);
   if(!count){return 1;}
-  gnutls_x509_crt_init(&peer->cert);
+  if(!peer->cert){gnutls_x509_crt_init(&peer->cert);}
   gnutls_x509_crt_import(peer->cert, certs, GNUTLS_X509_FMT_DER);
   // Get the certificate's public key ID
   size_t size=ID_SIZE;
@@ -274,41 +550,195 @@ static int checkcert(gnutls_session_t tls)
   return !memcmp(peer->id, peer_id, ID_SIZE);
 }
 
-static void generatecert(gnutls_certificate_credentials_t cred)
+static int checkcert(gnutls_session_t tls)
+{
+  // Find which peer the session belongs to
+  struct peer* peer=gnutls_session_get_ptr(tls);
+  if(!peer){return 1;}
+  return readcert(peer);
+}
+
+static void resume_save(struct peer* peer)
 {
+  // Only sessions we initiated have a ticket to resume with
+  if(!(gnutls_session_get_flags(peer->tls)&GNUTLS_SFLAGS_SESSION_TICKET)){return;}
+  gnutls_datum_t data;
+  if(gnutls_session_get_data2(peer->tls, &data)){return;}
+  struct resumedata* entry=0;
+  unsigned int i;
+  for(i=0; i<resumecount; ++i)
+  {
+    if(!memcmp(resumedata[i].id, peer->id, ID_SIZE))
+    {
+      entry=&resumedata[i];
+      gnutls_free(entry->data.data);
+      break;
+    }
+  }
+  if(!entry)
+  {
+    if(resumecount==RESUME_CACHE_SIZE) // Make room by dropping the oldest entry
+    {
+      gnutls_free(resumedata[0].data.data);
+      --resumecount;
+      memmove(&resumedata[0], &resumedata[1], sizeof(struct resumedata)*resumecount);
+    }
+    ++resumecount;
+    resumedata=realloc(resumedata, sizeof(struct resumedata)*resumecount);
+    entry=&resumedata[resumecount-1];
+    memcpy(entry->id, peer->id, ID_SIZE);
+  }
+  memcpy(&entry->addr, &peer->addr, peer->addrlen);
+  entry->addrlen=peer->addrlen;
+  entry->data=data;
+}
+
+static void resume_load(struct peer* peer)
+{
+  unsigned int i;
+  for(i=0; i<resumecount; ++i)
+  {
+    if(resumedata[i].addrlen==peer->addrlen && !memcmp(&resumedata[i].addr, &peer->addr, peer->addrlen))
+    {
+      gnutls_session_set_data(peer->tls, resumedata[i].data.data, resumedata[i].data.size);
+      return;
+    }
+  }
+}
+
+static struct credentials* credentials=0;
+static void credentials_release(struct credentials* cred)
+{
+  --cred->refcount;
+  if(cred->refcount){return;}
+  gnutls_certificate_free_credentials(cred->cred);
+  free(cred);
+}
+
+static struct credentials* credentials_get(void)
+{
+  // Share one certificate between all sessions and only regenerate it when it's halfway to expiring, signing a new certificate for every connection is expensive
+  time_t now=time(0);
+  if(credentials && credentials->timestamp+CERT_LIFETIME/2>now){return credentials;}
+  // Sessions still using the old credentials keep their own reference until they disconnect
+  if(credentials){credentials_release(credentials);}
+  credentials=malloc(sizeof(struct credentials));
+  credentials->timestamp=now;
+  credentials->refcount=1;
+  gnutls_certificate_allocate_credentials(&credentials->cred);
+  gnutls_certificate_set_verify_function(credentials->cred, checkcert);
   // Generate the certificate
   gnutls_x509_crt_t cert;
   gnutls_x509_crt_init(&cert);
   gnutls_x509_crt_set_key(cert, privkey);
-  gnutls_x509_crt_set_serial(cert, "", 1);
-  gnutls_x509_crt_set_activation_time(cert, time(0)-3600); // Allow up to an hour of time drift
-  gnutls_x509_crt_set_expiration_time(cert, time(0)+3600);
+  unsigned char serial[]={(now>>24)&0xff, (now>>16)&0xff, (now>>8)&0xff, now&0xff}; // Must be non-zero
+  gnutls_x509_crt_set_serial(cert, serial, sizeof(serial));
+  gnutls_x509_crt_set_activation_time(cert, now-CERT_LIFETIME); // Allow up to an hour of time drift
+  gnutls_x509_crt_set_expiration_time(cert, now+CERT_LIFETIME);
   gnutls_x509_crt_sign(cert, cert, privkey);
-  gnutls_certificate_set_x509_key(cred, &cert, 1, privkey);
+  gnutls_certificate_set_x509_key(credentials->cred, &cert, 1, privkey);
   gnutls_x509_crt_deinit(cert);
+  return credentials;
 }
 
 static struct peer* findpending(void)
 {
-  struct udpstream* stream=udpstream_poll();
-  if(stream)
+  struct udpstream* stream;
+  while((stream=udpstream_poll()))
   {
-    return peer_get(stream);
+    struct peer* peer=peer_get(stream);
+    if(peer){return peer;}
   }
   unsigned int i;
   for(i=0; i<peercount; ++i)
   {
-    if(gnutls_record_check_pending(peers[i]->tls)){return peers[i];}
+    if(!peers[i]->busy && gnutls_record_check_pending(peers[i]->tls)){return peers[i];}
   }
   return 0;
 }
 
+struct handshakejob
+{
+  struct peer* peer;
+  int result;
+};
+
+static void handshake_work(void* x)
+{
+  struct handshakejob* job=x;
+  job->result=gnutls_handshake(job->peer->tls);
+}
+
+static void dial_connected(struct peer* peer);
+static void handshake_finished(struct peer* peer)
+{
+  peer->handshake=1;
+  // Resumed sessions skip the certificate check, get the ID from the original session's certificate instead
+  if(gnutls_session_is_resumed(peer->tls))
+  {
+    ++peer_stats.resumedhandshakes;
+    if(readcert(peer)){peer_disconnect(peer, 0); return;}
+  }else{
+    ++peer_stats.fullhandshakes;
+  }
+  // A connection we started to someone we're already connected to (e.g. through another of their addresses) is redundant
+  struct peer* existing=hashtable_get(&peersbyid, peer->id, ID_SIZE);
+  if(!peer->server && existing && existing!=peer){peer_disconnect(peer, 1); return;}
+  dial_connected(peer);
+  hashtable_set(&peersbyid, peer->id, ID_SIZE, peer);
+  dht_addpeer(peer);
+  peercache_connected(peer);
+  sendcaps(peer);
+  peer_sendcmd(peer, "getpeers", 0, 0);
+}
+
+static void handlepending(void);
+static void handshake_done(void* x)
+{
+  struct handshakejob* job=x;
+  struct peer* peer=job->peer;
+  int res=job->result;
+  free(job);
+  char dropped=(peer->busy==2);
+  peer->busy=0;
+  udpstream_hold(peer->stream, 0);
+// TODO: GNUTLS_E_UNEXPECTED_HANDSHAKE_PACKET seems to indicate we're connecting to ourselves
+  if(dropped || gnutls_error_is_fatal(res)){peer_disconnect(peer, 0);}
+  else if(!res){handshake_finished(peer);}
+  // Handle anything that arrived while the stream was held
+  handlepending();
+}
+
+// Run the next step of the handshake on the thread pool, since it may involve slow public key operations
+static void handshake_start(struct peer* peer)
+{
+  struct handshakejob* job=malloc(sizeof(struct handshakejob));
+  job->peer=peer;
+  peer->busy=1;
+  udpstream_hold(peer->stream, 1);
+  ++peer_stats.offloadedhandshakes;
+  threadpool_run(handshake_work, handshake_done, job);
+}
+
 struct peer* peer_new(struct udpstream* stream, char server)
 {
   struct peer* peer=malloc(sizeof(struct peer));
   peer->peercount=0;
   peer->stream=stream;
   peer->handshake=0;
+  peer->busy=0;
+  peer->keep=0;
+  peer->server=server;
+  peer->caps=0;
+  peer->dictionary=0;
+  memset(peer->queue, 0, sizeof(peer->queue));
+  memset(peer->queuetail, 0, sizeof(peer->queuetail));
+  peer->queued=0;
+  peer->deficit=0;
+  peer->tokens=peerrate;
+  peer->tokentime=monotime();
+  peer->bytesin=0;
+  peer->bytesout=0;
   peer->cmdlength=0;
   peer->cmdname=0;
   peer->datalength=-1;
@@ -320,112 +750,413 @@ struct peer* peer_new(struct udpstream* stream, char server)
   // Priority
   gnutls_priority_set_direct(peer->tls, "NORMAL", 0);
   // Credentials
-  gnutls_certificate_credentials_t cert;
-  gnutls_certificate_allocate_credentials(&cert);
-  generatecert(cert);
-  gnutls_certificate_set_verify_function(cert, checkcert);
-  gnutls_credentials_set(peer->tls, GNUTLS_CRD_CERTIFICATE, cert);
+  peer->credentials=credentials_get();
+  ++peer->credentials->refcount;
+  gnutls_credentials_set(peer->tls, GNUTLS_CRD_CERTIFICATE, peer->credentials->cred);
   gnutls_certificate_server_set_request(peer->tls, GNUTLS_CERT_REQUIRE);
+  // Session resumption
+  if(server)
+  {
+    gnutls_session_ticket_enable_server(peer->tls, &ticketkey);
+  }else{
+    resume_load(peer);
+    peercache_attempt(&peer->addr, peer->addrlen);
+  }
 
   gnutls_transport_set_push_function(peer->tls, (gnutls_push_func)udpstream_write);
   gnutls_transport_set_pull_function(peer->tls, (gnutls_pull_func)udpstream_read);
 
   gnutls_transport_set_ptr(peer->tls, stream);
-  peer->handshake=!gnutls_handshake(peer->tls);
-  // TODO: handle gnutls_error_is_fatal(x)
+  gnutls_session_set_ptr(peer->tls, peer);
+  udpstream_setdata(stream, peer);
 
   ++peercount;
   peers=realloc(peers, sizeof(struct peer)*peercount);
   peers[peercount-1]=peer;
+  hashtable_set(&peersbyaddr, &peer->addr, peer->addrlen, peer);
+  handshake_start(peer);
   return peer;
 }
 
-struct peer* peer_get(struct udpstream* stream)
+// Token buckets for incoming handshakes by source address prefix (/24 for IPv4, /48 for IPv6), the least recently used one makes room when we run out
+struct admitbucket
+{
+  double tokens;
+  double timestamp;
+  unsigned char prefix[7];
+  unsigned int prefixlen;
+};
+static struct admitbucket admitbuckets[ADMIT_PREFIXES];
+static unsigned int admitbucketcount=0;
+static struct hashtable admitprefixes;
+
+static unsigned int admitprefix(struct sockaddr_storage* addr, socklen_t addrlen, unsigned char prefix[7])
 {
+  static const unsigned char v4mapped[]={0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+  const unsigned char* bytes;
+  if(addr->ss_family==AF_INET && addrlen>=sizeof(struct sockaddr_in))
+  {
+    bytes=(const unsigned char*)&((struct sockaddr_in*)addr)->sin_addr;
+  }
+  else if(addr->ss_family==AF_INET6 && addrlen>=sizeof(struct sockaddr_in6))
+  {
+    bytes=((struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+    if(memcmp(bytes, v4mapped, sizeof(v4mapped)))
+    {
+      prefix[0]=AF_INET6;
+      memcpy(&prefix[1], bytes, 6);
+      return 7;
+    }
+    bytes=&bytes[sizeof(v4mapped)];
+  }else{return 0;}
+  prefix[0]=AF_INET;
+  memcpy(&prefix[1], bytes, 3);
+  return 4;
+}
+
+// Decide whether to start a handshake with a new incoming connection
+static char admit(struct sockaddr_storage* addr, socklen_t addrlen)
+{
+  unsigned int halfopen=0;
   unsigned int i;
-  for(i=0; i<peercount; ++i)
+  for(i=0; i<peercount; ++i){halfopen+=!peers[i]->handshake;}
+  // Peers that we know worked before get in even when the rest are being held back
+  char known=peercache_known(addr, addrlen);
+  if(halfopen>=MAX_HALFOPEN+(known?HALFOPEN_RESERVED:0)){return 0;}
+  if(known){return 1;}
+  unsigned char prefix[7];
+  unsigned int prefixlen=admitprefix(addr, addrlen, prefix);
+  if(!prefixlen){return 1;}
+  double now=monotime();
+  struct admitbucket* bucket=hashtable_get(&admitprefixes, prefix, prefixlen);
+  if(!bucket)
   {
-    if(peers[i]->stream==stream){return peers[i];}
+    if(admitbucketcount==ADMIT_PREFIXES)
+    { // Reuse the stalest bucket, by now it has likely refilled to a full burst anyway
+      bucket=&admitbuckets[0];
+      for(i=1; i<admitbucketcount; ++i)
+      {
+        if(admitbuckets[i].timestamp<bucket->timestamp){bucket=&admitbuckets[i];}
+      }
+      hashtable_remove(&admitprefixes, bucket->prefix, bucket->prefixlen);
+    }else{
+      bucket=&admitbuckets[admitbucketcount++];
+    }
+    bucket->tokens=ADMIT_BURST;
+    bucket->timestamp=now;
+    memcpy(bucket->prefix, prefix, prefixlen);
+    bucket->prefixlen=prefixlen;
+    hashtable_set(&admitprefixes, prefix, prefixlen, bucket);
+  }
+  refill(&bucket->tokens, &bucket->timestamp, ADMIT_RATE, ADMIT_BURST, now);
+  if(bucket->tokens<1){return 0;}
+  bucket->tokens-=1;
+  return 1;
+}
+
+struct peer* peer_get(struct udpstream* stream)
+{
+  struct peer* peer=udpstream_getdata(stream);
+  if(peer){return peer;}
+  struct sockaddr_storage addr;
+  socklen_t addrlen=sizeof(addr);
+  udpstream_getaddr(stream, &addr, &addrlen);
+  if(!admit(&addr, addrlen))
+  {
+    ++peer_stats.rejectedhandshakes;
+    udpstream_close(stream);
+    return 0;
   }
   return peer_new(stream, 1);
 }
 
 struct peer* peer_new_unique(int sock, struct sockaddr_storage* addr, socklen_t addrlen)
 {
-  unsigned int i;
   // Make sure we're not already connected to this peer
-  for(i=0; i<peercount; ++i)
-  {
-    if(addrlen==peers[i]->addrlen && !memcmp(addr, &peers[i]->addr, addrlen)){return 0;}
-  }
+  if(hashtable_get(&peersbyaddr, addr, addrlen)){return 0;}
   struct udpstream* stream=udpstream_new(sock, addr, addrlen);
   return peer_new(stream, 0);
 }
 
-void peer_bootstrap(int sock, const char* peerlist)
+struct bootstrap
+{
+  int sock;
+  unsigned int pending;
+  unsigned int count;
+  void(*callback)(unsigned int,void*);
+  void* data;
+};
+
+// A bootstrap entry with addresses still waiting their turn, see bootstrap_dial()
+struct dial
+{
+  int sock;
+  struct addrinfo* ai;
+  struct addrinfo* next;
+  double nextat;
+};
+static struct dial* dials=0;
+static unsigned int dialcount=0;
+
+struct bootstrapentry
 {
-  const char* entry=peerlist;
-  while(entry)
-  {
-    while(strchr("\r\n ", entry[0])){entry=&entry[1];}
-    const char* end=strchr(entry, '\n');
-    if(!end){end=&entry[strlen(entry)];}
-    char peer[end-entry+1];
-    memcpy(peer, entry, end-entry);
-    peer[end-entry]=0;
-    entry=(end[0]?&end[1]:0);
-    char* port;
-    if((port=strchr(peer, '\r'))){port[0]=0;}
-    if(!(port=strrchr(peer, ':'))){continue;} // Bogus entry
-    port[0]=0;
+  struct bootstrap* bootstrap;
+  char* host;
+  char* port;
+  int family;
+  struct addrinfo* ai;
+};
+
+// Split the next <host>:<port> line off a peer list, returns 0 at the end of the list
+static char* bootstrap_next(const char** entry, char** host, char** port)
+{
+  while(*entry)
+  {
+    while(strchr("\r\n ", (*entry)[0]) && (*entry)[0]){*entry=&(*entry)[1];}
+    const char* end=strchr(*entry, '\n');
+    if(!end){end=&(*entry)[strlen(*entry)];}
+    char* line=strndup(*entry, end-*entry);
+    *entry=(end[0]?&end[1]:0);
+    char* p;
+    if((p=strchr(line, '\r'))){p[0]=0;}
+    if(!(p=strrchr(line, ':'))){free(line); continue;} // Bogus entry
+    p[0]=0;
+    *port=&p[1];
+    *host=line;
     // Strip [ and ] (IPv6)
-    char* host=peer;
-    if(host[0]=='[')
+    if(line[0]=='[')
     {
-      host=&host[1];
-      char* end=strchr(host, ']');
-      if(end){end[0]=0;}
+      *host=&line[1];
+      if((p=strchr(*host, ']'))){p[0]=0;}
     }
+    return line;
+  }
+  return 0;
+}
+
+// Only ask for addresses we can send to from the socket
+static int bootstrap_resolve(const char* host, const char* port, int family, struct addrinfo** ai)
+{
+  struct addrinfo hints={.ai_family=family, .ai_socktype=SOCK_DGRAM};
+  if(family==AF_INET6){hints.ai_flags=AI_V4MAPPED|AI_ALL;}
+  return getaddrinfo(host, port, &hints, ai);
+}
+
+// Start connecting to the next address of a dial, returns 0 once there are none left
+static char dial_next(struct dial* dial)
+{
+  while(dial->next)
+  {
+    struct addrinfo* ai=dial->next;
+    dial->next=ai->ai_next;
+    if(peer_new_unique(dial->sock, (struct sockaddr_storage*)ai->ai_addr, ai->ai_addrlen)){return 1;}
+  }
+  return 0;
+}
+
+static void dial_remove(unsigned int i)
+{
+  freeaddrinfo(dials[i].ai);
+  --dialcount;
+  memmove(&dials[i], &dials[i+1], sizeof(struct dial)*(dialcount-i));
+}
+
+// Try the addresses one at a time, a moment apart (happy eyeballs), and use whichever gets through first, takes over ai
+static unsigned int bootstrap_dial(int sock, struct addrinfo* ai)
+{
+  struct dial dial={.sock=sock, .ai=ai, .next=ai, .nextat=monotime()+BOOTSTRAP_STAGGER};
+  if(!dial_next(&dial)){freeaddrinfo(ai); return 0;}
+  if(!dial.next){freeaddrinfo(ai); return 1;}
+  ++dialcount;
+  dials=realloc(dials, sizeof(struct dial)*dialcount);
+  dials[dialcount-1]=dial;
+  return 1;
+}
+
+// Start the next attempt of bootstrap entries whose last one didn't get through in time
+static void dial_stagger(void)
+{
+  double now=monotime();
+  unsigned int i;
+  for(i=0; i<dialcount; ++i)
+  {
+    if(dials[i].nextat>now){continue;}
+    // Entries stay around for a while after their last attempt, so the others are dropped if that one gets through
+    if(!dials[i].next || !dial_next(&dials[i])){dial_remove(i); --i; continue;}
+    dials[i].nextat=now+(dials[i].next?BOOTSTRAP_STAGGER:BOOTSTRAP_TIMEOUT);
+  }
+}
+
+// Once one of a bootstrap entry's addresses completes the handshake, drop the attempts on the others
+static void dial_connected(struct peer* peer)
+{
+  unsigned int i;
+  for(i=0; i<dialcount; ++i)
+  {
     struct addrinfo* ai;
-    if(!getaddrinfo(host, &port[1], 0, &ai))
+    for(ai=dials[i].ai; ai!=dials[i].next; ai=ai->ai_next)
+    {
+      if(ai->ai_addrlen==peer->addrlen && !memcmp(ai->ai_addr, &peer->addr, ai->ai_addrlen)){break;}
+    }
+    if(ai==dials[i].next){continue;}
+    for(ai=dials[i].ai; ai!=dials[i].next; ai=ai->ai_next)
     {
-      peer_new_unique(sock, (struct sockaddr_storage*)ai->ai_addr, ai->ai_addrlen);
-      freeaddrinfo(ai);
+      struct peer* attempt=hashtable_get(&peersbyaddr, ai->ai_addr, ai->ai_addrlen);
+      if(attempt && attempt!=peer && !attempt->handshake){peer_disconnect(attempt, 0);}
     }
+    dial_remove(i);
+    return;
+  }
+}
+
+static int sockfamily(int sock)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen=sizeof(addr);
+  if(getsockname(sock, (struct sockaddr*)&addr, &addrlen)){return AF_UNSPEC;}
+  return addr.ss_family;
+}
+
+void peer_bootstrap(int sock, const char* peerlist)
+{
+  int family=sockfamily(sock);
+  char* line;
+  char* host;
+  char* port;
+  while((line=bootstrap_next(&peerlist, &host, &port)))
+  {
+    struct addrinfo* ai;
+    if(!bootstrap_resolve(host, port, family, &ai)){bootstrap_dial(sock, ai);}
+    free(line);
+  }
+}
+
+static void bootstrap_work(void* x)
+{
+  struct bootstrapentry* entry=x;
+  if(bootstrap_resolve(entry->host, entry->port, entry->family, &entry->ai)){entry->ai=0;}
+}
+
+static void bootstrap_release(struct bootstrap* bootstrap)
+{
+  if(--bootstrap->pending){return;}
+  if(bootstrap->callback){bootstrap->callback(bootstrap->count, bootstrap->data);}
+  free(bootstrap);
+}
+
+static void bootstrap_done(void* x)
+{
+  struct bootstrapentry* entry=x;
+  struct bootstrap* bootstrap=entry->bootstrap;
+  if(entry->ai){bootstrap->count+=bootstrap_dial(bootstrap->sock, entry->ai);}
+  free(entry->host);
+  free(entry->port);
+  free(entry);
+  bootstrap_release(bootstrap);
+}
+
+void peer_bootstrap_async(int sock, const char* peerlist, void(*callback)(unsigned int,void*), void* data)
+{
+  struct bootstrap* bootstrap=malloc(sizeof(struct bootstrap));
+  bootstrap->sock=sock;
+  bootstrap->pending=1; // Held until every entry has been queued
+  bootstrap->count=0;
+  bootstrap->callback=callback;
+  bootstrap->data=data;
+  int family=sockfamily(sock);
+  char* line;
+  char* host;
+  char* port;
+  while((line=bootstrap_next(&peerlist, &host, &port)))
+  {
+    struct bootstrapentry* entry=malloc(sizeof(struct bootstrapentry));
+    entry->bootstrap=bootstrap;
+    entry->host=strdup(host);
+    entry->port=strdup(port);
+    free(line);
+    entry->family=family;
+    entry->ai=0;
+    ++bootstrap->pending;
+    threadpool_run(bootstrap_work, bootstrap_done, entry);
+  }
+  bootstrap_release(bootstrap); // Completes right away if the list was empty
+}
+
+// Compressed payloads are <uncompressed length, 4><dictionary ID, 4, 0 for none><raw deflate stream>
+static unsigned char* deflatepayload(const void* data, uint32_t len, char usedict, uint32_t* outlen)
+{
+  z_stream z={0};
+  if(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)!=Z_OK){return 0;}
+  uint32_t dictid=0;
+  if(usedict)
+  {
+    deflateSetDictionary(&z, dictionary, dictionarylen);
+    dictid=dictionaryid;
   }
+  unsigned int headerlen=sizeof(len)+sizeof(dictid);
+  uLong bound=deflateBound(&z, len);
+  unsigned char* out=malloc(headerlen+bound);
+  memcpy(out, &len, sizeof(len));
+  memcpy(out+sizeof(len), &dictid, sizeof(dictid));
+  z.next_in=(Bytef*)data;
+  z.avail_in=len;
+  z.next_out=out+headerlen;
+  z.avail_out=bound;
+  int res=deflate(&z, Z_FINISH);
+  *outlen=headerlen+z.total_out;
+  deflateEnd(&z);
+  if(res!=Z_STREAM_END || *outlen>=len){free(out); return 0;} // Not worth it
+  return out;
+}
+
+static unsigned char* inflatepayload(const unsigned char* data, uint32_t len, uint32_t* outlen)
+{
+  uint32_t dictid;
+  if(len<sizeof(*outlen)+sizeof(dictid)){return 0;}
+  memcpy(outlen, data, sizeof(*outlen));
+  memcpy(&dictid, data+sizeof(*outlen), sizeof(dictid));
+  if(*outlen>MAX_INFLATED || (dictid && dictid!=dictionaryid)){return 0;}
+  z_stream z={0};
+  if(inflateInit2(&z, -15)!=Z_OK){return 0;}
+  if(dictid){inflateSetDictionary(&z, dictionary, dictionarylen);}
+  unsigned char* out=malloc(*outlen+1);
+  z.next_in=(Bytef*)data+sizeof(*outlen)+sizeof(dictid);
+  z.avail_in=len-sizeof(*outlen)-sizeof(dictid);
+  z.next_out=out;
+  z.avail_out=*outlen;
+  int res=inflate(&z, Z_FINISH);
+  char ok=(res==Z_STREAM_END && z.total_out==*outlen);
+  inflateEnd(&z);
+  if(!ok){free(out); return 0;}
+  out[*outlen]=0;
+  return out;
 }
 
 #define readordie(x,y,z) {ssize_t r=gnutls_record_recv(x->tls,y,z); if(z && r<1){peer_disconnect(x, 0); continue;}}
-void peer_handlesocket(int sock) // Incoming data
+static void handlepending(void)
 {
-  udpstream_readsocket(sock); // If it locks up here we're probably missing a bootstrap node
   struct peer* peer;
   while((peer=findpending()))
   {
     if(!peer->handshake)
     {
-// TODO: GNUTLS_E_UNEXPECTED_HANDSHAKE_PACKET seems to indicate we're connecting to ourselves
-      int res=gnutls_handshake(peer->tls);
-      if(gnutls_error_is_fatal(res)){peer_disconnect(peer, 0); continue;}
-      peer->handshake=!res;
-  // TODO: handle gnutls_error_is_fatal(x)?
-      if(peer->handshake)
-      {
-        peer_sendcmd(peer, "getpeers", 0, 0);
-      }
+      if(!peer->busy){handshake_start(peer);}
       continue;
     }
     // Get command name, data, and then call the callbacks registered for the command
     if(!peer->cmdlength)
     {
-      readordie(peer, &peer->cmdlength, sizeof(peer->cmdlength));
+      // Post-handshake messages (e.g. session tickets) may leave no application data to read yet
+      ssize_t r=gnutls_record_recv(peer->tls, &peer->cmdlength, sizeof(peer->cmdlength));
+      if(r<1 && r!=GNUTLS_E_AGAIN){peer_disconnect(peer, 0);}
       continue;
     }
     else if(!peer->cmdname)
     {
-      peer->cmdname=malloc(peer->cmdlength+1);
-      readordie(peer, peer->cmdname, peer->cmdlength);
-      peer->cmdname[peer->cmdlength]=0;
+      uint8_t namelen=peer->cmdlength&~CMD_DEFLATED;
+      peer->cmdname=malloc(namelen+1);
+      readordie(peer, peer->cmdname, namelen);
+      peer->cmdname[namelen]=0;
       continue;
     }
     else if(peer->datalength<0)
@@ -433,19 +1164,44 @@ void peer_handlesocket(int sock) // Incoming data
       readordie(peer, &peer->datalength, sizeof(peer->datalength));
       if(peer->datalength){continue;} // If it's a 0-length command just keep going
     }
-printf("Received command '%s' from peer "PEERFMT"\n", peer->cmdname, PEERARG(peer->id));
+    LOG(LOGLEVEL_DEBUG, "Received command '%s' from peer "PEERFMT, peer->cmdname, PEERARG(peer->id));
     // Call the relevant callback, if any
     char data[peer->datalength+1]; // TODO: malloc instead? or somehow conditionally
     readordie(peer, data, peer->datalength);
     data[peer->datalength]=0;
+    struct peer_cmdstats* stats=getcmdstats(peer->cmdname, 0);
+    if(!stats){stats=getcmdstats("(unknown)", 1);}
+    ++stats->received;
+    stats->bytesin+=sizeof(peer->cmdlength)+(peer->cmdlength&~CMD_DEFLATED)+sizeof(peer->datalength)+peer->datalength;
+    peer->bytesin+=sizeof(peer->cmdlength)+(peer->cmdlength&~CMD_DEFLATED)+sizeof(peer->datalength)+peer->datalength;
+    void* payload=data;
+    uint32_t payloadlen=peer->datalength;
+    unsigned char* inflated=0;
+    if(peer->cmdlength&CMD_DEFLATED)
+    {
+      inflated=inflatepayload((unsigned char*)data, peer->datalength, &payloadlen);
+      if(!inflated){peer_disconnect(peer, 0); continue;}
+      payload=inflated;
+      peer_stats.inflatedin+=peer->datalength;
+      peer_stats.inflatedout+=payloadlen;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     unsigned int i;
     for(i=0; i<commandcount; ++i)
     {
       if(!strcmp(commands[i].name, peer->cmdname))
       {
-        commands[i].callback(peer, data, peer->datalength);
+        commands[i].callback(peer, payload, payloadlen);
       }
     }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t usec=(end.tv_sec-start.tv_sec)*1000000+(end.tv_nsec-start.tv_nsec)/1000;
+    unsigned int bucket=0;
+    while(usec && bucket<PEER_CMDSTATS_BUCKETS-1){usec>>=1; ++bucket;}
+    ++stats->handlertime[bucket];
+    free(inflated);
     free(peer->cmdname);
     peer->cmdname=0;
     peer->cmdlength=0;
@@ -453,35 +1209,237 @@ printf("Received command '%s' from peer "PEERFMT"\n", peer->cmdname, PEERARG(pee
   }
 }
 
-void peer_sendcmd(struct peer* peer, const char* cmd, const void* data, uint32_t len)
+static void sendqueued(void);
+void peer_handlesocket(int sock) // Incoming data
 {
-  if(!peer) // Broadcast to all connected peers
+  udpstream_readsocket(sock); // If it locks up here we're probably missing a bootstrap node
+  peers_maintain(sock);
+  threadpool_handle(); // In case the event loop isn't watching threadpool_fd()
+  handlepending();
+  sendqueued(); // Acknowledgements may have made room for more
+}
+
+// Seconds until the bandwidth limits allow sending to the peer again, 0 if they do now. Sending may take the buckets below 0 so commands larger than a burst still go through
+static double throttled(struct peer* peer)
+{
+  double now=monotime();
+  double wait=0;
+  if(peerrate)
+  {
+    refill(&peer->tokens, &peer->tokentime, peerrate, peerrate, now);
+    if(peer->tokens<=0){wait=-peer->tokens/peerrate;}
+  }
+  if(totalrate)
   {
+    refill(&totaltokens, &totaltimestamp, totalrate, totalrate, now);
+    if(totaltokens<=0 && -totaltokens/totalrate>wait){wait=-totaltokens/totalrate;}
+  }
+  return wait;
+}
+
+static char cansend(struct peer* peer)
+{
+  return peer->handshake && !peer->busy && udpstream_unacked(peer->stream)<MAX_UNACKED && !throttled(peer);
+}
+
+// Deficit round robin between peers, strict priority order within each peer's queues
+static void sendqueued(void)
+{
+  char progress=1;
+  while(progress)
+  {
+    progress=0;
     unsigned int i;
     for(i=0; i<peercount; ++i)
     {
-      if(!peers[i]->handshake){continue;}
-      peer_sendcmd(peers[i], cmd, data, len);
+      struct peer* peer=peers[(nextsender+i)%peercount];
+      if(!peer->queued || !cansend(peer)){continue;}
+      peer->deficit+=SEND_QUANTUM*(peer->keep?2:1);
+      progress=1;
+      unsigned int priority=0;
+      char sent=0;
+      while(priority<PEER_PRIORITIES && cansend(peer))
+      {
+        struct queuedcmd* cmd=peer->queue[priority];
+        if(!cmd){++priority; continue;}
+        if((int)cmd->len>peer->deficit){break;} // Wait for our next turn
+        peer->queue[priority]=cmd->next;
+        if(!cmd->next){peer->queuetail[priority]=0;}
+        peer->queued-=cmd->len;
+        peer->deficit-=cmd->len;
+        peer->tokens-=cmd->len;
+        totaltokens-=cmd->len;
+        peer->bytesout+=cmd->len;
+        gnutls_record_cork(peer->tls);
+        gnutls_record_send(peer->tls, cmd->data, cmd->len);
+        gnutls_record_uncork(peer->tls, GNUTLS_RECORD_WAIT);
+        free(cmd);
+        sent=1;
+      }
+      if(sent && drainhandler){drainhandler(peer);} // Let bulk senders queue their next part
+      if(!peer->queued){peer->deficit=0;} // Idle peers don't save up
     }
-    return;
   }
+  if(peercount){nextsender=(nextsender+1)%peercount;}
+}
+
+static void sendraw(struct peer* peer, const char* cmd, uint8_t flags, const void* data, uint32_t len, enum peer_priority priority)
+{
   uint8_t cmdlen=strlen(cmd);
-  gnutls_record_cork(peer->tls);
-  gnutls_record_send(peer->tls, &cmdlen, sizeof(cmdlen));
-  gnutls_record_send(peer->tls, cmd, cmdlen);
-  gnutls_record_send(peer->tls, &len, sizeof(len));
-  gnutls_record_send(peer->tls, data, len);
-  gnutls_record_uncork(peer->tls, GNUTLS_RECORD_WAIT);
+  if(priority==PEER_PRIORITY_MEDIA && peer->queued+sizeof(cmdlen)+cmdlen+sizeof(len)+len>MAX_QUEUED)
+  { // The peer isn't keeping up, don't let its queue grow without bounds
+    ++peer_stats.droppedcmds;
+    return;
+  }
+  struct peer_cmdstats* stats=getcmdstats(cmd, 1);
+  ++stats->sent;
+  stats->bytesout+=sizeof(cmdlen)+cmdlen+sizeof(len)+len;
+  struct queuedcmd* item=malloc(sizeof(struct queuedcmd)+sizeof(cmdlen)+cmdlen+sizeof(len)+len);
+  item->next=0;
+  item->len=sizeof(cmdlen)+cmdlen+sizeof(len)+len;
+  item->data[0]=cmdlen|flags;
+  memcpy(&item->data[sizeof(cmdlen)], cmd, cmdlen);
+  memcpy(&item->data[sizeof(cmdlen)+cmdlen], &len, sizeof(len));
+  memcpy(&item->data[sizeof(cmdlen)+cmdlen+sizeof(len)], data, len);
+  if(peer->queued || !cansend(peer)){++peer_stats.deferredcmds;}
+  if(peer->queuetail[priority])
+  {
+    peer->queuetail[priority]->next=item;
+  }else{
+    peer->queue[priority]=item;
+  }
+  peer->queuetail[priority]=item;
+  peer->queued+=item->len;
+}
+
+struct packed
+{
+  char tried;
+  unsigned char* data;
+  uint32_t len;
+};
+
+// Compress at most once with and once without the dictionary, even when broadcasting
+static void sendpacked(struct peer* peer, const char* cmd, const void* data, uint32_t len, enum peer_priority priority, struct packed packed[2])
+{
+  if(len>=DEFLATE_THRESHOLD && (peer->caps&PEER_CAP_DEFLATE))
+  {
+    char usedict=(dictionaryid && peer->dictionary==dictionaryid);
+    struct packed* p=&packed[(int)usedict];
+    if(!p->tried)
+    {
+      p->tried=1;
+      p->data=deflatepayload(data, len, usedict, &p->len);
+    }
+    if(p->data)
+    {
+      peer_stats.deflatedin+=len;
+      peer_stats.deflatedout+=p->len;
+      sendraw(peer, cmd, CMD_DEFLATED, p->data, p->len, priority);
+      return;
+    }
+  }
+  sendraw(peer, cmd, 0, data, len, priority);
+}
+
+void peer_sendcmd_priority(struct peer* peer, const char* cmd, const void* data, uint32_t len, enum peer_priority priority)
+{
+  if(priority>=PEER_PRIORITIES){priority=PEER_PRIORITIES-1;}
+  struct packed packed[2]={{0}};
+  if(peer)
+  {
+    sendpacked(peer, cmd, data, len, priority, packed);
+  }else{ // Broadcast to all connected peers
+    unsigned int i;
+    for(i=0; i<peercount; ++i)
+    {
+      if(!peers[i]->handshake){continue;}
+      sendpacked(peers[i], cmd, data, len, priority, packed);
+    }
+  }
+  free(packed[0].data);
+  free(packed[1].data);
+  sendqueued();
+}
+
+void peer_sendcmd(struct peer* peer, const char* cmd, const void* data, uint32_t len)
+{
+  peer_sendcmd_priority(peer, cmd, data, len, PEER_PRIORITY_CONTROL);
+}
+
+void peer_setbandwidth(uint32_t perpeer, uint32_t total)
+{
+  unsigned int i;
+  for(i=0; i<peercount; ++i){peers[i]->tokens=perpeer;}
+  peerrate=perpeer;
+  totalrate=total;
+  totaltokens=total;
+  totaltimestamp=monotime();
+  sendqueued(); // In case we lifted a limit
+}
+
+int peer_flushtimeout(void)
+{
+  double wait=-1;
+  unsigned int i;
+  for(i=0; i<peercount; ++i)
+  {
+    struct peer* peer=peers[i];
+    if(!peer->queued || !peer->handshake || peer->busy || udpstream_unacked(peer->stream)>=MAX_UNACKED){continue;} // Acknowledgements or resends will wake us up
+    double peerwait=throttled(peer);
+    if(wait<0 || peerwait<wait){wait=peerwait;}
+  }
+  // Lost packets are resent after a timeout, after which they no longer hold back their peer's queue
+  double resendwait=udpstream_resendtimeout();
+  if(resendwait>=0 && (wait<0 || resendwait<wait)){wait=resendwait;}
+  double now=monotime();
+  for(i=0; i<dialcount; ++i)
+  {
+    double dialwait=(dials[i].nextat>now?dials[i].nextat-now:0);
+    if(wait<0 || dialwait<wait){wait=dialwait;}
+  }
+  return (wait<0?-1:(int)(wait*1000)+1);
+}
+
+void peer_setdrainhandler(void(*callback)(struct peer*))
+{
+  drainhandler=callback;
+}
+
+void peer_flush(void)
+{
+  dial_stagger();
+  udpstream_resend();
+  sendqueued();
 }
 
 void peer_disconnect(struct peer* peer, char cleanly)
 {
+  if(peer->busy){peer->busy=2; return;} // Disconnect once the worker thread is done with it
+  if(peer->handshake){resume_save(peer);}
+  unsigned int priority;
+  for(priority=0; priority<PEER_PRIORITIES; ++priority)
+  {
+    while(peer->queue[priority])
+    {
+      struct queuedcmd* next=peer->queue[priority]->next;
+      free(peer->queue[priority]);
+      peer->queue[priority]=next;
+    }
+  }
   if(cleanly){gnutls_bye(peer->tls, GNUTLS_SHUT_WR);}
   gnutls_deinit(peer->tls);
+  credentials_release(peer->credentials);
   if(peer->cert){gnutls_x509_crt_deinit(peer->cert);}
+  udpstream_setdata(peer->stream, 0);
   udpstream_close(peer->stream);
-  free(peer->cmdname);
-  free(peer);
+  if(hashtable_get(&peersbyaddr, &peer->addr, peer->addrlen)==peer)
+  {
+    hashtable_remove(&peersbyaddr, &peer->addr, peer->addrlen);
+  }
+  if(peer->handshake){view_add(&peer->addr, peer->addrlen, 0);} // Might be worth reconnecting to later
+  char byid=(hashtable_get(&peersbyid, peer->id, ID_SIZE)==peer);
+  if(byid){hashtable_remove(&peersbyid, peer->id, ID_SIZE);}
   unsigned int i;
   for(i=0; i<peercount; ++i)
   {
@@ -489,8 +1447,16 @@ void peer_disconnect(struct peer* peer, char cleanly)
     {
       --peercount;
       memmove(&peers[i], &peers[i+1], sizeof(void*)*(peercount-i));
+      --i;
+    }
+    else if(byid && peers[i]->handshake && !memcmp(peers[i]->id, peer->id, ID_SIZE))
+    { // Still connected to the same ID through another session
+      hashtable_set(&peersbyid, peer->id, ID_SIZE, peers[i]);
+      byid=0;
     }
   }
+  free(peer->cmdname);
+  free(peer);
 }
 
 void peer_findpeer(const unsigned char id[ID_SIZE])
@@ -500,18 +1466,25 @@ void peer_findpeer(const unsigned char id[ID_SIZE])
   unsigned char data[len];
   memcpy(data, id, ID_SIZE);
   memcpy(data+ID_SIZE, &ttl, sizeof(ttl));
-  peer_sendcmd(0, "findpeer", data, len);
+  // Route the request greedily towards the target, and look for closer peers to route through in case it gets stuck
+  struct peer* next=closestpeer(id, 0, 0);
+  if(next){peer_sendcmd(next, "findpeer", data, len);}
+  dht_lookup(id);
+}
+
+struct peer_cmdstats* peer_getcmdstats(const char* cmd)
+{
+  return getcmdstats(cmd, 0);
+}
+
+const char* peer_listcmds(unsigned int index)
+{
+  return (index<cmdstatscount?cmdstats[index]->name:0);
 }
 
 struct peer* peer_findbyid(const unsigned char id[ID_SIZE])
 {
-  unsigned int i;
-  for(i=0; i<peercount; ++i)
-  {
-    if(!peers[i]->handshake){continue;}
-    if(!memcmp(peers[i]->id, id, ID_SIZE)){return peers[i];}
-  }
-  return 0;
+  return hashtable_get(&peersbyid, id, ID_SIZE);
 }
 
 void peer_exportpeers(const char* path)
@@ -525,7 +1498,7 @@ void peer_exportpeers(const char* path)
     char addr[INET6_ADDRSTRLEN];
     char port[64];
     if(getnameinfo((struct sockaddr*)&peers[i]->addr, peers[i]->addrlen, addr, INET6_ADDRSTRLEN, port, 64, NI_NUMERICHOST|NI_NUMERICSERV|NI_DGRAM)){continue;}
-    const char* fmt=((peers[i]->addr.ss_family==AF_INET6)?"[%s]:%s":"%s:%s");
+    const char* fmt=((peers[i]->addr.ss_family==AF_INET6)?"[%s]:%s\n":"%s:%s\n");
     dprintf(f, fmt, addr, port);
   }
   close(f);
@@ -32,13 +32,61 @@
 * Number of bytes required to store a (binary) peer ID
 */
 #define ID_SIZE 32
+/**
+* PEER_CAP_DEFLATE:
+*
+* Capability flag for peers that accept deflate-compressed command payloads
+*/
+#define PEER_CAP_DEFLATE 1
+/**
+* PEER_CAP_UPDATESBATCH:
+*
+* Capability flag for peers that understand batched "updatesbatch" catch-up commands
+*/
+#define PEER_CAP_UPDATESBATCH 2
+
+struct credentials;
+struct queuedcmd;
+
+/**
+* peer_priority:
+* @PEER_PRIORITY_CONTROL: Small requests and replies others are waiting on, e.g. findpeer or getpubkey
+* @PEER_PRIORITY_INTERACTIVE: Fresh updates
+* @PEER_PRIORITY_CATCHUP: Older updates sent to a peer catching up
+* @PEER_PRIORITY_MEDIA: Bulk transfers
+* @PEER_PRIORITIES: Number of priority levels
+*
+* Priorities for outgoing commands, each level is only sent once the levels above it are empty, see peer_sendcmd_priority()
+*/
+enum peer_priority
+{
+  PEER_PRIORITY_CONTROL=0,
+  PEER_PRIORITY_INTERACTIVE,
+  PEER_PRIORITY_CATCHUP,
+  PEER_PRIORITY_MEDIA,
+  PEER_PRIORITIES
+};
 
 /**
 * peer:
 * @peercount: The number of other peers this peer is connected to
 * @stream: The UDP stream connection to this peer
 * @tls: The TLS session on top of the UDP stream
+* @credentials: Shared TLS credentials used by the session
 * @handshake: Whether the TLS handshake has been completed
+* @busy: 1 while a worker thread is using the TLS session for the handshake, 2 if the peer should be disconnected once it's done
+* @keep: Never disconnect this peer to make room for others (e.g. because it's a friend)
+* @server: Whether the peer connected to us, rather than us to them
+* @caps: Capabilities the peer announced after the handshake, e.g. #PEER_CAP_DEFLATE
+* @dictionary: ID of the compression dictionary the peer uses, 0 if none, see peer_setdictionary()
+* @queue: Outgoing commands waiting to be sent, for each priority
+* @queuetail: Last command of each queue
+* @queued: Number of bytes waiting in the queues
+* @deficit: Bytes the peer may still send in the current scheduling round
+* @tokens: Bytes the peer may send before its bandwidth limit holds it back, see peer_setbandwidth()
+* @tokentime: When @tokens was last topped up
+* @bytesin: Bytes of commands received from the peer
+* @bytesout: Bytes of commands sent to the peer
 * @cmdlength: Length of an incomplete incoming command's name
 * @cmdname: Name of incomplete incoming command
 * @datalength: Length of an incomplete incoming command's data/parameters
@@ -54,7 +102,21 @@ struct peer
   unsigned int peercount;
   struct udpstream* stream;
   gnutls_session_t tls;
+  struct credentials* credentials;
   char handshake;
+  char busy;
+  char keep;
+  char server;
+  uint32_t caps;
+  uint32_t dictionary;
+  struct queuedcmd* queue[PEER_PRIORITIES];
+  struct queuedcmd* queuetail[PEER_PRIORITIES];
+  unsigned int queued;
+  int deficit;
+  double tokens;
+  double tokentime;
+  uint64_t bytesin;
+  uint64_t bytesout;
   uint8_t cmdlength;
   char* cmdname;
   int32_t datalength;
@@ -65,6 +127,66 @@ struct peer
   // TODO: Account stuff?
 };
 
+/**
+* peerstats:
+* @fullhandshakes: Number of completed TLS handshakes that did a full certificate exchange
+* @resumedhandshakes: Number of completed TLS handshakes that resumed an earlier session
+* @findpeersuppressed: Number of findpeer requests dropped because we already handled them recently
+* @findpeerforwarded: Number of findpeer requests passed on to other peers
+* @evictedpeers: Number of peers disconnected because we had too many
+* @offloadedhandshakes: Number of handshake steps run on the thread pool
+* @rejectedhandshakes: Number of incoming connections turned away by admission control
+* @deflatedin: Payload bytes sent compressed, before compression
+* @deflatedout: Payload bytes sent compressed, after compression
+* @inflatedin: Compressed payload bytes received
+* @inflatedout: Compressed payload bytes received, after decompression
+* @deferredcmds: Number of outgoing commands that had to wait for earlier ones or for the peer to catch up
+* @droppedcmds: Number of outgoing #PEER_PRIORITY_MEDIA commands dropped because too much was already waiting for the peer
+*
+* Counters for the peer layer, see #peer_stats
+*/
+struct peerstats
+{
+  unsigned int fullhandshakes;
+  unsigned int resumedhandshakes;
+  uint64_t findpeersuppressed;
+  uint64_t findpeerforwarded;
+  unsigned int evictedpeers;
+  uint64_t offloadedhandshakes;
+  uint64_t rejectedhandshakes;
+  uint64_t deflatedin;
+  uint64_t deflatedout;
+  uint64_t inflatedin;
+  uint64_t inflatedout;
+  uint64_t deferredcmds;
+  uint64_t droppedcmds;
+};
+
+/**
+* PEER_CMDSTATS_BUCKETS:
+*
+* Number of buckets in the command handler time histogram
+*/
+#define PEER_CMDSTATS_BUCKETS 16
+/**
+* peer_cmdstats:
+* @received: Number of times the command was received
+* @sent: Number of times the command was sent
+* @bytesin: Bytes received for the command, including the command header
+* @bytesout: Bytes sent for the command, including the command header
+* @handlertime: Histogram of time spent in the command's handlers, bucket 0 counts calls taking under 1 microsecond, bucket n counts those taking 2^(n-1) to 2^n microseconds, and the last bucket everything slower
+*
+* Counters for a command, see peer_getcmdstats()
+*/
+struct peer_cmdstats
+{
+  uint64_t received;
+  uint64_t sent;
+  uint64_t bytesin;
+  uint64_t bytesout;
+  uint64_t handlertime[PEER_CMDSTATS_BUCKETS];
+};
+
 /**
 * PEERFMT:
 *
@@ -80,6 +202,7 @@ struct peer
 #define PEERARG(x) x[0],x[1],x[2],x[3],x[4],x[5],x[6],x[7],x[8],x[9],x[10],x[11],x[12],x[13],x[14],x[15],x[16],x[17],x[18],x[19],x[20],x[21],x[22],x[23],x[24],x[25],x[26],x[27],x[28],x[29],x[30],x[31]
 extern unsigned char peer_id[ID_SIZE];
 extern gnutls_privkey_t peer_privkey;
+extern struct peerstats peer_stats;
 
 /**
 * peer_registercmd:
@@ -92,36 +215,143 @@ extern gnutls_privkey_t peer_privkey;
 */
 extern void peer_registercmd(const char* name, void(*callback)(struct peer*,void*,unsigned int));
 extern void peer_init(const char* keypath);
+/**
+* peer_signalgo:
+* @pk: Public key algorithm of the identity key
+*
+* Get the signature algorithm used with identity keys of the given type
+* Returns: The signature algorithm
+*/
+extern gnutls_sign_algorithm_t peer_signalgo(gnutls_pk_algorithm_t pk);
 extern struct peer* peer_new(struct udpstream* stream, char server);
+/**
+* peer_get:
+* @stream: UDP stream
+*
+* Get the peer using a stream, starting a server-side handshake if it's a new incoming connection.
+* New connections are limited by the number of incomplete handshakes and the rate of handshakes from the same network, with some extra room for peers we have been connected to before
+* Returns: The peer, or NULL if the connection was turned away
+*/
 extern struct peer* peer_get(struct udpstream* stream);
 extern struct peer* peer_new_unique(int sock, struct sockaddr_storage* addr, socklen_t addrlen);
+/**
+* peer_bootstrap:
+* @sock: UDP socket
+* @peerlist: Newline-separated list of <host>:<port> entries
+*
+* Connect to each entry, resolving one entry at a time. Blocks while resolving, see peer_bootstrap_async()
+* An entry's addresses are tried one after another a moment apart from peer_flush(), until one of them completes a handshake
+*/
 extern void peer_bootstrap(int sock, const char* peerlist);
 /**
+* peer_bootstrap_async:
+* @sock: UDP socket
+* @peerlist: Newline-separated list of <host>:<port> entries
+* @callback: Called once every entry has been resolved and dialed, with the number of connections started and @data, may be NULL
+* @data: Argument for @callback
+*
+* Like peer_bootstrap() but resolves all entries concurrently on the thread pool. The event loop must call threadpool_handle() when threadpool_fd() becomes readable
+*/
+extern void peer_bootstrap_async(int sock, const char* peerlist, void(*callback)(unsigned int,void*), void* data);
+/**
 * peer_handlesocket:
 * @sock: UDP socket
 *
 * Handle incoming network data, calls callbacks registered with peer_registercmd()
+* Handshakes run on the thread pool, so the event loop should also call threadpool_handle() when threadpool_fd() is readable
 */
 extern void peer_handlesocket(int sock);
 /**
 * peer_sendcmd:
 * @peer: Recipient peer
-* @cmd: Command name
+* @cmd: Command name, up to 127 bytes
 * @data: Parameter data
 * @len: Length of data
 *
-* Send a command/request to another peer
+* Send a command/request to another peer, or to every connected peer if @peer is NULL.
+* Larger payloads are compressed for peers that support it. Same as peer_sendcmd_priority() with #PEER_PRIORITY_CONTROL
 */
 extern void peer_sendcmd(struct peer* peer, const char* cmd, const void* data, uint32_t len);
+/**
+* peer_sendcmd_priority:
+* @peer: Recipient peer, or NULL for every connected peer
+* @cmd: Command name, up to 127 bytes
+* @data: Parameter data
+* @len: Length of data
+* @priority: Priority level
+*
+* Queue a command for sending. Commands are held back while a peer has too many unacknowledged packets,
+* higher priorities go first for each peer, and peers take turns sending about the same amount of data (twice as much for peers marked with @keep)
+*/
+extern void peer_sendcmd_priority(struct peer* peer, const char* cmd, const void* data, uint32_t len, enum peer_priority priority);
+/**
+* peer_setbandwidth:
+* @perpeer: Bytes per second we may send to each peer, 0 for no limit
+* @total: Bytes per second we may send in total, 0 for no limit
+*
+* Limit outgoing bandwidth, allowing bursts of up to a second's worth. Commands over the limit wait in their queues, see peer_flushtimeout()
+*/
+extern void peer_setbandwidth(uint32_t perpeer, uint32_t total);
+/**
+* peer_flushtimeout:
+*
+* Get how long until queued commands held back by peer_setbandwidth() may be sent, lost packets resent or the next bootstrap address tried, for use as a poll() timeout
+* Returns: Milliseconds until peer_flush() should be called, or -1 if nothing is waiting
+*/
+extern int peer_flushtimeout(void);
+/**
+* peer_flush:
+*
+* Resend lost packets, try the next address of bootstrap entries that haven't connected yet and send queued commands that are no longer held back, see peer_flushtimeout()
+*/
+extern void peer_flush(void);
+/**
+* peer_setdrainhandler:
+* @callback: Function to call with the peer, or NULL
+*
+* Set a function to call after queued commands have been sent to a peer, so large amounts of data (e.g. catching up on updates) can be queued a part at a time as the peer keeps up instead of all at once, based on its queued bytes
+*/
+extern void peer_setdrainhandler(void(*callback)(struct peer*));
 extern void peer_disconnect(struct peer* peer, char cleanly);
 /**
+* peer_setdictionary:
+* @data: Dictionary, typically fragments commonly found in command payloads, most common last
+* @len: Length of dictionary
+*
+* Set a preset dictionary for compressing command payloads, used with peers that set the same dictionary
+*/
+extern void peer_setdictionary(const void* data, unsigned int len);
+/**
+* peer_addcaps:
+* @caps: Capability flags, e.g. #PEER_CAP_UPDATESBATCH
+*
+* Announce capabilities implemented by the application on top of the ones peer itself supports
+*/
+extern void peer_addcaps(uint32_t caps);
+/**
 * peer_findpeer:
 * @id: Peer ID
 *
-* Find and ask a peer to connect to us
+* Find and ask a peer to connect to us, routing the request towards @id by XOR distance and running a dht_lookup() alongside it
 */
 extern void peer_findpeer(const unsigned char id[ID_SIZE]);
 /**
+* peer_getcmdstats:
+* @cmd: Command name
+*
+* Get the counters for a command. Received commands that aren't registered are counted as "(unknown)"
+* Returns: The counters, or NULL if the command hasn't been registered, sent or received
+*/
+extern struct peer_cmdstats* peer_getcmdstats(const char* cmd);
+/**
+* peer_listcmds:
+* @index: Index, starting at 0
+*
+* List the commands that have counters, for use with peer_getcmdstats()
+* Returns: The name of the command at @index, or NULL past the end of the list
+*/
+extern const char* peer_listcmds(unsigned int index);
+/**
 * peer_findbyid:
 * @id: Peer ID
 *
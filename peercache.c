@@ -0,0 +1,219 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "peer.h"
+#include "peercache.h"
+#define SAVE_INTERVAL 60
+#define CACHE_MAGIC 0x31435050 // "PPC1"
+
+struct cacheentry
+{
+  unsigned char id[ID_SIZE];
+  struct sockaddr_storage addr;
+  uint16_t addrlen;
+  int64_t lastseen;
+  uint32_t rtt; // Milliseconds from dialing to completed handshake, averaged
+  uint32_t successes;
+  uint32_t attempts;
+  uint64_t attempttime; // Not saved, when we last dialed it
+};
+
+static struct cacheentry cache[PEERCACHE_SIZE];
+static unsigned int cachecount=0;
+static char* cachepath=0;
+static time_t savetime=0;
+static char dirty=0;
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+static double score(struct cacheentry* entry, time_t now)
+{
+  double rate=(entry->successes+1.0)/(entry->attempts+2.0); // Smoothed so a single success or failure doesn't decide everything
+  double age=(now>entry->lastseen?now-entry->lastseen:0)/86400.0;
+  return rate/(1+age)/(1+entry->rtt/250.0);
+}
+
+static struct cacheentry* findaddr(struct sockaddr_storage* addr, socklen_t addrlen)
+{
+  unsigned int i;
+  for(i=0; i<cachecount; ++i)
+  {
+    if(cache[i].addrlen==addrlen && !memcmp(&cache[i].addr, addr, addrlen)){return &cache[i];}
+  }
+  return 0;
+}
+
+static struct cacheentry* newentry(void)
+{
+  struct cacheentry* entry;
+  if(cachecount<PEERCACHE_SIZE){entry=&cache[cachecount++];}
+  else
+  { // Replace the lowest ranked entry
+    time_t now=time(0);
+    entry=&cache[0];
+    unsigned int i;
+    for(i=1; i<cachecount; ++i)
+    {
+      if(score(&cache[i], now)<score(entry, now)){entry=&cache[i];}
+    }
+  }
+  memset(entry, 0, sizeof(struct cacheentry));
+  return entry;
+}
+
+void peercache_load(const char* path)
+{
+  free(cachepath);
+  cachepath=strdup(path);
+  savetime=time(0);
+  FILE* f=fopen(path, "r");
+  if(!f){return;}
+  uint32_t magic;
+  if(fread(&magic, sizeof(magic), 1, f)!=1 || magic!=CACHE_MAGIC){fclose(f); return;}
+  cachecount=0;
+  // <id, 32><addrlen, 2><addr><lastseen, 8><rtt, 4><successes, 4><attempts, 4>
+  struct cacheentry entry={.attempttime=0};
+  while(cachecount<PEERCACHE_SIZE && fread(entry.id, ID_SIZE, 1, f)==1)
+  {
+    if(fread(&entry.addrlen, sizeof(entry.addrlen), 1, f)!=1 || entry.addrlen>sizeof(entry.addr)){break;}
+    if(fread(&entry.addr, entry.addrlen, 1, f)!=1 ||
+       fread(&entry.lastseen, sizeof(entry.lastseen), 1, f)!=1 ||
+       fread(&entry.rtt, sizeof(entry.rtt), 1, f)!=1 ||
+       fread(&entry.successes, sizeof(entry.successes), 1, f)!=1 ||
+       fread(&entry.attempts, sizeof(entry.attempts), 1, f)!=1){break;}
+    cache[cachecount++]=entry;
+  }
+  fclose(f);
+}
+
+void peercache_save(void)
+{
+  if(!cachepath){return;}
+  // Write to a temporary file and move it into place so a crash can't leave us with half a cache
+  char tmppath[strlen(cachepath)+5];
+  sprintf(tmppath, "%s.tmp", cachepath);
+  FILE* f=fopen(tmppath, "w");
+  if(!f){return;}
+  uint32_t magic=CACHE_MAGIC;
+  fwrite(&magic, sizeof(magic), 1, f);
+  unsigned int i;
+  for(i=0; i<cachecount; ++i)
+  {
+    fwrite(cache[i].id, ID_SIZE, 1, f);
+    fwrite(&cache[i].addrlen, sizeof(cache[i].addrlen), 1, f);
+    fwrite(&cache[i].addr, cache[i].addrlen, 1, f);
+    fwrite(&cache[i].lastseen, sizeof(cache[i].lastseen), 1, f);
+    fwrite(&cache[i].rtt, sizeof(cache[i].rtt), 1, f);
+    fwrite(&cache[i].successes, sizeof(cache[i].successes), 1, f);
+    fwrite(&cache[i].attempts, sizeof(cache[i].attempts), 1, f);
+  }
+  if(fclose(f)){unlink(tmppath); return;}
+  rename(tmppath, cachepath);
+  savetime=time(0);
+  dirty=0;
+}
+
+unsigned int peercache_bootstrap(int sock, unsigned int count)
+{
+  if(!cachecount){return 0;} // Nothing to pick from (and no zero-length arrays)
+  time_t now=time(0);
+  double scores[cachecount];
+  char picked[cachecount];
+  unsigned int i;
+  for(i=0; i<cachecount; ++i)
+  {
+    scores[i]=score(&cache[i], now);
+    // Skip peers that never worked, and don't try to connect to ourselves
+    picked[i]=(!cache[i].successes || !memcmp(cache[i].id, peer_id, ID_SIZE));
+  }
+  unsigned int dialed=0;
+  while(dialed<count)
+  {
+    int best=-1;
+    for(i=0; i<cachecount; ++i)
+    {
+      if(!picked[i] && (best<0 || scores[i]>scores[best])){best=i;}
+    }
+    if(best<0){break;}
+    picked[best]=1;
+    // Handshakes with all of them proceed in parallel as their packets arrive
+    if(peer_new_unique(sock, &cache[best].addr, cache[best].addrlen)){++dialed;}
+  }
+  return dialed;
+}
+
+char peercache_known(struct sockaddr_storage* addr, socklen_t addrlen)
+{
+  struct cacheentry* entry=findaddr(addr, addrlen);
+  return entry && entry->successes;
+}
+
+void peercache_attempt(struct sockaddr_storage* addr, socklen_t addrlen)
+{
+  if(addrlen>sizeof(struct sockaddr_storage)){return;}
+  struct cacheentry* entry=findaddr(addr, addrlen);
+  if(!entry)
+  { // Never seen until it connects, so it'll be the first to go if it doesn't
+    entry=newentry();
+    memcpy(&entry->addr, addr, addrlen);
+    entry->addrlen=addrlen;
+  }
+  ++entry->attempts;
+  entry->attempttime=now_ms();
+  dirty=1;
+}
+
+void peercache_connected(struct peer* peer)
+{
+  if(peer->addrlen>sizeof(struct sockaddr_storage)){return;}
+  struct cacheentry* entry=findaddr(&peer->addr, peer->addrlen);
+  unsigned int i;
+  for(i=0; !entry && i<cachecount; ++i)
+  { // Same peer at a new address
+    if(!memcmp(cache[i].id, peer->id, ID_SIZE)){entry=&cache[i];}
+  }
+  if(!entry){entry=newentry();}
+  if(entry->attempttime)
+  { // We dialed it, measure how long the handshake took
+    uint32_t rtt=now_ms()-entry->attempttime;
+    entry->rtt=(entry->rtt?(entry->rtt*7+rtt)/8:rtt);
+    entry->attempttime=0;
+  }else{
+    ++entry->attempts; // They connected to us
+  }
+  memcpy(entry->id, peer->id, ID_SIZE);
+  memcpy(&entry->addr, &peer->addr, peer->addrlen);
+  entry->addrlen=peer->addrlen;
+  entry->lastseen=time(0);
+  ++entry->successes;
+  dirty=1;
+}
+
+void peercache_maintain(void)
+{
+  if(dirty && time(0)-savetime>=SAVE_INTERVAL){peercache_save();}
+}
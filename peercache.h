@@ -0,0 +1,70 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+* SECTION:peercache
+* @title: Peer cache
+* @short_description: Remembers good peers between runs
+*
+* Keeps track of peers we have been connected to along with how reliable and fast they were, saved to disk so that restarting nodes can reconnect to the best of them right away
+*/
+#ifndef PEERCACHE_H
+#define PEERCACHE_H
+#include "peer.h"
+/**
+* PEERCACHE_SIZE:
+*
+* Maximum number of peers kept in the cache, the lowest ranked ones are replaced when it's full
+*/
+#define PEERCACHE_SIZE 256
+
+/**
+* peercache_load:
+* @path: Cache file
+*
+* Load the peer cache, the cache will also be saved to this file periodically and by peercache_save()
+*/
+extern void peercache_load(const char* path);
+/**
+* peercache_save:
+*
+* Write the peer cache to the file given to peercache_load()
+*/
+extern void peercache_save(void);
+/**
+* peercache_bootstrap:
+* @sock: UDP socket
+* @count: Maximum number of peers to connect to
+*
+* Connect to the best ranked cached peers by success rate, last time seen and round-trip time, all at once
+* Returns: The number of peers we started connecting to
+*/
+extern unsigned int peercache_bootstrap(int sock, unsigned int count);
+/**
+* peercache_known:
+* @addr: Address
+* @addrlen: Length of address
+*
+* Check whether we have successfully connected to a peer at this address before
+* Returns: 1 if we have, otherwise 0
+*/
+extern char peercache_known(struct sockaddr_storage* addr, socklen_t addrlen);
+// Record outgoing connection attempts and completed handshakes, called by peer.c
+extern void peercache_attempt(struct sockaddr_storage* addr, socklen_t addrlen);
+extern void peercache_connected(struct peer* peer);
+// Save the cache if it changed a while ago, called periodically by peer_handlesocket()
+extern void peercache_maintain(void);
+#endif
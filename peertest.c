@@ -20,6 +20,8 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include "peer.h"
+#include "threadpool.h"
+#include "log.h"
 
 void gotmsg(struct peer* peer, void* data, unsigned int size)
 {
@@ -37,14 +39,15 @@ int main(int argc, char** argv)
     bind(sock, ai->ai_addr, ai->ai_addrlen);
     freeaddrinfo(ai);
   }
+  log_level=LOGLEVEL_DEBUG;
   peer_init("priv.pem");
   peer_registercmd("msg", gotmsg);
-  peer_bootstrap(sock, "127.0.0.1:4000");
-  struct pollfd pfd[]={{.fd=0, .events=POLLIN, .revents=0}, {.fd=sock, .events=POLLIN, .revents=0}};
+  peer_bootstrap_async(sock, "127.0.0.1:4000", 0, 0);
+  struct pollfd pfd[]={{.fd=0, .events=POLLIN, .revents=0}, {.fd=sock, .events=POLLIN, .revents=0}, {.fd=threadpool_fd(), .events=POLLIN, .revents=0}};
   char buf[1024];
   while(1)
   {
-    poll(pfd, 2, -1);
+    if(!poll(pfd, 3, peer_flushtimeout())){peer_flush();}
     if(pfd[0].revents) // stdin
     {
       pfd[0].revents=0;
@@ -56,6 +59,11 @@ int main(int argc, char** argv)
       pfd[1].revents=0;
       peer_handlesocket(sock);
     }
+    if(pfd[2].revents) // Finished background work
+    {
+      pfd[2].revents=0;
+      threadpool_handle();
+    }
   }
   return 0;
 }
@@ -16,23 +16,76 @@
 */
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/poll.h>
+#include <dirent.h>
+#include <time.h>
 #include <gnutls/abstract.h>
 #include "peer.h"
+#include "threadpool.h"
+#include "log.h"
+#include "hashtable.h"
 #include "buffer.h"
 #include "update.h"
 #include "social.h"
+#define BATCH_SIZE 65536 // Bytes of updates per "updatesbatch" chunk
+#define CATCHUP_QUEUED (4*BATCH_SIZE) // Bytes waiting for a peer before catching it up on more updates waits for them to be sent
+struct socialstats social_stats={0};
+char social_parallelload=0;
 struct user** social_users=0;
 unsigned int social_usercount=0;
+static struct hashtable usersbyid;
 struct user* social_self;
 char* social_prefix=0;
 // Abstract away all the messagepassing and present information more or less statically
 // TODO: Think about privacy for all data updates
 // TODO: We must also sign all data updates to prevent forgeries
 
+// Preset compression dictionary, fragments often found in updates and public keys with the most common last. Changing it only means peers with the old one get plain compression
+static const char dictionary[]=
+  "\x30\x82\x01\x22\x30\x0d\x06\x09\x2a\x86\x48\x86\xf7\x0d\x01\x01\x01\x05\x00\x03\x82\x01\x0f\x00\x30\x82\x01\x0a\x02\x82\x01\x01\x00" // RSA public key header
+  "https://www.http://.com/.org/.net/"
+  "birthday\0location\0website\0description\0"
+  " the and to of that is in it you for was on with this have but are not"
+  "name\0"
+  "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
+static double elapsed(struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-start->tv_sec)+(now.tv_nsec-start->tv_nsec)/1000000000.0;
+}
+
+struct verifyjob
+{
+  struct user* user;
+  unsigned int len;
+  char valid;
+  unsigned char data[];
+};
+
+static void verify_work(void* x)
+{
+  struct verifyjob* job=x;
+  job->valid=social_update_verify(job->user, job->data, job->len);
+}
+
+static void verify_done(void* x)
+{
+  struct verifyjob* job=x;
+  if(job->valid)
+  {
+    struct update* update=social_update_apply(job->user, job->data, job->len);
+    if(update){social_update_save(job->user, update);}
+  }
+  free(job);
+}
+
 static void updateinfo(struct peer* peer, void* data, unsigned int len)
 {
   // <id, 32><sigsize, 4><signature><seq, 8><type, 1><timestamp, 8><type-specific data>
@@ -43,8 +96,103 @@ static void updateinfo(struct peer* peer, void* data, unsigned int len)
     if(user){peer_sendcmd(peer, "getpubkey", data, ID_SIZE);}
     return;
   }
-  struct update* update=social_update_parse(user, data+ID_SIZE, len-ID_SIZE);
-  if(update){social_update_save(user, update);}
+  if(!social_update_precheck(user, data+ID_SIZE, len-ID_SIZE)){return;}
+  // Verify the signature on the thread pool and apply the update back on the event loop
+  struct verifyjob* job=malloc(sizeof(struct verifyjob)+len-ID_SIZE);
+  job->user=user;
+  job->len=len-ID_SIZE;
+  memcpy(job->data, data+ID_SIZE, len-ID_SIZE);
+  threadpool_run(verify_work, verify_done, job);
+}
+
+struct batchjob
+{
+  struct user* user;
+  unsigned int count;
+  char* valid;
+  unsigned char data[];
+};
+
+static void batch_work(void* x)
+{
+  struct batchjob* job=x;
+  unsigned char* data=job->data;
+  unsigned int i;
+  for(i=0; i<job->count; ++i)
+  {
+    uint32_t size;
+    memcpy(&size, data, sizeof(size));
+    if(job->valid[i]){job->valid[i]=social_update_verify(job->user, data+sizeof(size), size);}
+    data+=sizeof(size)+size;
+  }
+}
+
+static void batch_done(void* x)
+{
+  struct batchjob* job=x;
+  uint64_t* seqs=malloc(sizeof(uint64_t)*job->count);
+  unsigned int applied=0;
+  unsigned char* data=job->data;
+  unsigned int i;
+  for(i=0; i<job->count; ++i)
+  {
+    uint32_t size;
+    memcpy(&size, data, sizeof(size));
+    struct update* update=(job->valid[i]?social_update_apply(job->user, data+sizeof(size), size):0);
+    if(update){seqs[applied]=update->seq; ++applied;}
+    data+=sizeof(size)+size;
+  }
+  social_update_savemany(job->user, seqs, applied);
+  free(seqs);
+  free(job->valid);
+  free(job);
+}
+
+static void updatesbatch(struct peer* peer, void* data, unsigned int len)
+{
+  // <id, 32>[<size, 4><sigsize, 4><signature><seq, 8><type, 1><timestamp, 8><type-specific data>]...
+  if(len<ID_SIZE){return;}
+  struct user* user=social_finduser(data);
+  if(!user || !user->pubkey)
+  {
+    if(user){peer_sendcmd(peer, "getpubkey", data, ID_SIZE);}
+    return;
+  }
+  // Check the framing up front so the worker and apply steps can trust it
+  unsigned int count=0;
+  unsigned int pos=ID_SIZE;
+  while(pos<len)
+  {
+    uint32_t size;
+    if(len-pos<sizeof(size)){return;}
+    memcpy(&size, data+pos, sizeof(size));
+    pos+=sizeof(size);
+    if(len-pos<size){return;}
+    pos+=size;
+    ++count;
+  }
+  if(!count){return;}
+  // Only verify what isn't already known
+  char* valid=malloc(count);
+  char needed=0;
+  unsigned int i;
+  for(pos=ID_SIZE, i=0; i<count; ++i)
+  {
+    uint32_t size;
+    memcpy(&size, data+pos, sizeof(size));
+    pos+=sizeof(size);
+    valid[i]=social_update_precheck(user, data+pos, size);
+    needed|=valid[i];
+    pos+=size;
+  }
+  if(!needed){free(valid); return;}
+  // Verify all the signatures in one go on the thread pool, then apply and save them together
+  struct batchjob* job=malloc(sizeof(struct batchjob)+len-ID_SIZE);
+  job->user=user;
+  job->count=count;
+  job->valid=valid;
+  memcpy(job->data, data+ID_SIZE, len-ID_SIZE);
+  threadpool_run(batch_work, batch_done, job);
 }
 
 static void user_save(struct user* user)
@@ -64,45 +212,42 @@ static void user_save(struct user* user)
   close(f);
 }
 
-static void user_loadfrom(struct user* user, const char* suffix)
+static int user_openupdates(struct user* user, const char* suffix)
 {
   char path[strlen(social_prefix)+strlen("/updates/0")+ID_SIZE*2+strlen(suffix)];
   sprintf(path, "%s/updates/"PEERFMT"%s", social_prefix, PEERARG(user->id), suffix);
+  return open(path, O_RDONLY);
+}
+
+static void user_loadfrom(struct user* user, const char* suffix)
+{
+  int f=user_openupdates(user, suffix);
+  if(f<0){return;}
+  while(social_update_load(user, f));
+  close(f);
+}
+
+// Load public key if it isn't already set
+static void user_loadkey(struct user* user)
+{
+  if(user->pubkey){return;}
+  char path[strlen(social_prefix)+strlen("/users/0")+ID_SIZE*2];
+  sprintf(path, "%s/users/"PEERFMT, social_prefix, PEERARG(user->id));
   int f=open(path, O_RDONLY);
   if(f<0){return;}
-  uint64_t size;
-  while(read(f, &size, sizeof(size))==sizeof(size))
-  {
-    uint8_t buf[size];
-    read(f, buf, size);
-    social_update_parse(user, buf, size);
-  }
+  uint32_t size;
+  read(f, &size, sizeof(size));
+  unsigned char keydata[size];
+  read(f, keydata, size);
+  close(f);
+  gnutls_datum_t key={.data=keydata, .size=size};
+  gnutls_pubkey_init(&user->pubkey);
+  gnutls_pubkey_import(user->pubkey, &key, GNUTLS_X509_FMT_PEM);
 }
 
-static void user_load(struct user* user)
+// Count the number of rotated updates we have for the user (updates which we don't load here but can be loaded with social_user_loadmore() on demand)
+static void user_countrotations(struct user* user)
 {
-  // Load public key if it isn't already set
-  if(!user->pubkey)
-  {
-    char path[strlen(social_prefix)+strlen("/users/0")+ID_SIZE*2];
-    sprintf(path, "%s/users/"PEERFMT, social_prefix, PEERARG(user->id));
-    int f=open(path, O_RDONLY);
-    if(f>=0)
-    {
-      uint32_t size;
-      read(f, &size, sizeof(size));
-      unsigned char keydata[size];
-      read(f, keydata, size);
-      close(f);
-      gnutls_datum_t key={.data=keydata, .size=size};
-      gnutls_pubkey_init(&user->pubkey);
-      gnutls_pubkey_import(user->pubkey, &key, GNUTLS_X509_FMT_PEM);
-    }
-  }
-  // Load updates (sticky and unrotated)
-  user_loadfrom(user, ".sticky");
-  user_loadfrom(user, "");
-  // Count the number of rotated updates we have for the user (updates which we don't load here but can be loaded with social_user_loadmore() on demand)
   unsigned int i;
   for(i=0; i<UINT_MAX; ++i)
   {
@@ -113,34 +258,198 @@ static void user_load(struct user* user)
   user->rotationcount=i;
 }
 
-static struct user* user_new(const unsigned char id[ID_SIZE])
+static void user_load(struct user* user)
+{
+  user_loadkey(user);
+  // Load updates (sticky and unrotated)
+  user_loadfrom(user, ".sticky");
+  user_loadfrom(user, "");
+  user_countrotations(user);
+}
+
+// Add a user to the global tables without loading anything for it yet
+static struct user* user_alloc(const unsigned char id[ID_SIZE])
 {
   struct user* user=malloc(sizeof(struct user));
   memcpy(user->id, id, ID_SIZE);
+  user->handle=social_usercount;
   user->pubkey=0;
   user->peer=peer_findbyid(id);
+  if(user->peer){user->peer->keep=1;}
   user->circles=0;
   user->circlecount=0;
+  user->viewers=0;
   user->seq=0;
   user->updates=0;
   user->updatecount=0;
+  user->seqindex=0;
   user->rotation=0;
   user->rotationcount=0;
   ++social_usercount;
   social_users=realloc(social_users, sizeof(void*)*social_usercount);
   social_users[social_usercount-1]=user;
+  hashtable_set(&usersbyid, user->id, ID_SIZE, user);
+  return user;
+}
+
+static struct user* user_new(const unsigned char id[ID_SIZE])
+{
+  struct user* user=user_alloc(id);
   user_load(user);
   return user;
 }
 
+struct loadrecord
+{
+  unsigned char* data;
+  unsigned int len;
+  uint64_t seq;
+  char trusted;
+  char valid;
+};
+
+struct loadjob
+{
+  struct user* user;
+  struct loadrecord* records;
+  unsigned int count;
+  unsigned int avoided;
+};
+
+static unsigned int loadpending;
+
+static void load_readfrom(struct loadjob* job, const char* suffix)
+{
+  int f=user_openupdates(job->user, suffix);
+  if(f<0){return;}
+  struct loadrecord record;
+  while((record.data=social_update_read(job->user, f, &record.len, &record.trusted)))
+  {
+    ++job->count;
+    job->records=realloc(job->records, sizeof(struct loadrecord)*job->count);
+    job->records[job->count-1]=record;
+  }
+  close(f);
+}
+
+// Same as social_update_precheck() would do when loading one at a time: drop copies of the same sequence number and updates superseded by a newer one for the same field or friend
+static void load_dedup(struct loadjob* job)
+{
+  struct hashtable seqs;
+  struct hashtable keys;
+  hashtable_init(&seqs);
+  hashtable_init(&keys);
+  struct buffer key;
+  buffer_init(key);
+  unsigned int i;
+  for(i=0; i<job->count; ++i)
+  {
+    struct loadrecord* record=&job->records[i];
+    record->valid=0;
+    if(!social_update_key(record->data, record->len, &record->seq, &key)){continue;}
+    if(hashtable_get(&seqs, &record->seq, sizeof(record->seq))){++job->avoided; continue;}
+    hashtable_set(&seqs, &record->seq, sizeof(record->seq), record);
+    record->valid=1;
+    if(!key.size){continue;}
+    struct loadrecord* other=hashtable_get(&keys, key.buf, key.size);
+    if(other && other->seq>record->seq){record->valid=0; ++job->avoided; continue;}
+    if(other){other->valid=0; ++job->avoided;}
+    hashtable_set(&keys, key.buf, key.size, record);
+  }
+  buffer_deinit(key);
+  hashtable_deinit(&seqs);
+  hashtable_deinit(&keys);
+}
+
+// Read and verify everything for one user, only touching that user
+static void load_work(void* x)
+{
+  struct loadjob* job=x;
+  user_loadkey(job->user);
+  load_readfrom(job, ".sticky");
+  load_readfrom(job, "");
+  user_countrotations(job->user);
+  load_dedup(job);
+  unsigned int i;
+  for(i=0; i<job->count; ++i)
+  {
+    struct loadrecord* record=&job->records[i];
+    if(record->valid && !record->trusted){record->valid=social_update_verify(job->user, record->data, record->len);}
+  }
+}
+
+static void load_done(void* x)
+{
+  (void)x;
+  --loadpending;
+}
+
+// Find all users we have public keys for, read and verify their updates on the thread pool, then apply them all here
+static void user_loadall(void)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  char path[strlen(social_prefix)+strlen("/users")+1];
+  sprintf(path, "%s/users", social_prefix);
+  DIR* dir=opendir(path);
+  if(!dir){return;}
+  struct loadjob* jobs=0;
+  unsigned int jobcount=0;
+  char threaded=(threadpool_fd()>=0); // Without worker threads nothing would ever finish, just load one at a time
+  struct dirent* entry;
+  while((entry=readdir(dir)))
+  {
+    if(strlen(entry->d_name)!=ID_SIZE*2){continue;}
+    unsigned char id[ID_SIZE];
+    unsigned int i;
+    for(i=0; i<ID_SIZE && sscanf(&entry->d_name[i*2], "%2hhx", &id[i])==1; ++i);
+    if(i<ID_SIZE || social_finduser(id)){continue;}
+    if(!threaded){user_new(id); continue;}
+    ++jobcount;
+    jobs=realloc(jobs, sizeof(struct loadjob)*jobcount);
+    jobs[jobcount-1].user=user_alloc(id);
+    jobs[jobcount-1].records=0;
+    jobs[jobcount-1].count=0;
+    jobs[jobcount-1].avoided=0;
+  }
+  closedir(dir);
+  loadpending=jobcount;
+  unsigned int i;
+  for(i=0; i<jobcount; ++i){threadpool_run(load_work, load_done, &jobs[i]);}
+  struct pollfd pfd={.fd=threadpool_fd(), .events=POLLIN, .revents=0};
+  while(loadpending)
+  {
+    poll(&pfd, 1, -1);
+    threadpool_handle();
+  }
+  double readtime=elapsed(&start);
+  // Applying updates can add users to circles, so it happens in one place once every user is known
+  unsigned int records=0;
+  for(i=0; i<jobcount; ++i)
+  {
+    unsigned int j;
+    for(j=0; j<jobs[i].count; ++j)
+    {
+      struct loadrecord* record=&jobs[i].records[j];
+      if(record->valid && social_update_apply(jobs[i].user, record->data, record->len) && record->trusted){++social_stats.trustedloads;}
+      free(record->data);
+    }
+    records+=jobs[i].count;
+    social_stats.verificationsavoided+=jobs[i].avoided;
+    free(jobs[i].records);
+  }
+  free(jobs);
+  LOG(LOGLEVEL_DEBUG, "Read and verified %u updates of %u users in %.1fms, applied them in %.1fms", records, jobcount, readtime*1000, (elapsed(&start)-readtime)*1000);
+}
+
 static struct user* user_findfriend(struct user* user, const unsigned char id[ID_SIZE])
 {
-  unsigned int i, i2;
+  struct user* friend=social_finduser(id);
+  if(!friend){return 0;}
+  unsigned int i;
   for(i=0; i<user->circlecount; ++i)
-  for(i2=0; i2<user->circles[i].count; ++i2)
   {
-    struct user* user2=social_self->circles[i].friends[i2];
-    if(!memcmp(user2->id, id, ID_SIZE)){return user2;}
+    if(social_circle_contains(&user->circles[i], friend)){return friend;}
   }
   return 0;
 }
@@ -152,6 +461,7 @@ static void greetpeer(struct peer* peer, void* data, unsigned int len)
   if(user)
   {
     user->peer=peer;
+    peer->keep=1; // Stay connected to people we care about
     if(!user->pubkey)
     {
       gnutls_pubkey_init(&user->pubkey);
@@ -172,7 +482,7 @@ static void greetpeer(struct peer* peer, void* data, unsigned int len)
     for(i=0; i<social_self->circlecount; ++i)
     for(i2=0; i2<social_self->circles[i].count; ++i2)
     {
-      struct user* friend=social_self->circles[i].friends[i2];
+      struct user* friend=social_users[social_self->circles[i].friends[i2]];
       if(friend->peer){continue;}
       if(user_findfriend(user, friend->id))
       { // Friend of friend, ask for updates
@@ -195,16 +505,79 @@ static void greetpeer(struct peer* peer, void* data, unsigned int len)
   }
 }
 
-static void sendupdate(struct peer* peer, const unsigned char id[ID_SIZE], struct update* update)
+static void sendupdate(struct peer* peer, struct update* update, enum peer_priority priority)
 {
-  struct buffer buf;
-  buffer_init(buf);
-  buffer_write(buf, id, ID_SIZE);
-  buffer_write(buf, &update->signaturesize, sizeof(update->signaturesize));
-  buffer_write(buf, update->signature, update->signaturesize);
-  social_update_write(&buf, update);
-  peer_sendcmd(peer, "updateinfo", buf.buf, buf.size);
-  buffer_deinit(buf);
+  if(!update->encoded){return;} // Not signed yet
+  peer_sendcmd_priority(peer, "updateinfo", update->encoded, update->encodedsize, priority);
+}
+
+// Where a peer's "getupdates" request for a user has got to, the rest is queued as the peer keeps up, see catchup_drained()
+struct catchup
+{
+  unsigned char peer[ID_SIZE];
+  unsigned char user[ID_SIZE];
+  uint64_t seq;
+};
+static struct catchup* catchups=0;
+static unsigned int catchupcount=0;
+
+static void catchup_remove(unsigned int i)
+{
+  --catchupcount;
+  memmove(&catchups[i], &catchups[i+1], sizeof(struct catchup)*(catchupcount-i));
+}
+
+// Queue updates after catchup->seq until the peer has CATCHUP_QUEUED bytes waiting, returns 0 once everything has been queued
+static char catchup_send(struct peer* peer, struct catchup* catchup)
+{
+  if(peer->queued>=CATCHUP_QUEUED){return 1;}
+  struct user* user=social_finduser(catchup->user);
+  if(!user){return 0;}
+  struct user* peeruser=social_finduser(peer->id);
+  if(!peeruser){peeruser=user_new(peer->id);}
+  const struct circlemask* mask=social_user_circlemask(user, peeruser);
+  // Updates go out in "updatesbatch" chunks, each with the user ID once and handled as a group on the other end
+  // Peers that don't announce support for it get one "update" at a time
+  char batched=!!(peer->caps&PEER_CAP_UPDATESBATCH);
+  struct buffer batch;
+  buffer_init(batch);
+  struct update* update;
+  for(update=social_update_after(user, catchup->seq); update; update=social_update_after(user, update->seq))
+  {
+    catchup->seq=update->seq;
+    // Check privacy rules
+    if(!social_privacy_checkmask(&update->privacy, mask)){continue;}
+    if(!batched)
+    {
+      sendupdate(peer, update, PEER_PRIORITY_CATCHUP);
+      if(peer->queued>=CATCHUP_QUEUED){break;}
+      continue;
+    }
+    if(!batch.size){buffer_write(batch, user->id, ID_SIZE);}
+    uint32_t size=update->encodedsize-ID_SIZE;
+    buffer_write(batch, &size, sizeof(size));
+    buffer_write(batch, update->encoded+ID_SIZE, size);
+    if(batch.size>=BATCH_SIZE)
+    {
+      peer_sendcmd_priority(peer, "updatesbatch", batch.buf, batch.size, PEER_PRIORITY_CATCHUP);
+      batch.size=0;
+      if(peer->queued>=CATCHUP_QUEUED){break;}
+    }
+  }
+  if(batch.size){peer_sendcmd_priority(peer, "updatesbatch", batch.buf, batch.size, PEER_PRIORITY_CATCHUP);}
+  buffer_deinit(batch);
+  return !!update;
+}
+
+// Continue catch-ups as the peer's queue empties
+static void catchup_drained(struct peer* peer)
+{
+  unsigned int i;
+  for(i=0; i<catchupcount && peer->queued<CATCHUP_QUEUED; ++i)
+  {
+    if(memcmp(catchups[i].peer, peer->id, ID_SIZE)){continue;}
+    if(!catchup_send(peer, &catchups[i])){catchup_remove(i); --i;}
+  }
 }
 
 static void sendupdates(struct peer* peer, void* data, unsigned int len)
@@ -213,21 +586,26 @@ static void sendupdates(struct peer* peer, void* data, unsigned int len)
   uint64_t seq;
   if(len<ID_SIZE+sizeof(seq)){return;}
   memcpy(&seq, data+ID_SIZE, sizeof(seq));
-  struct user* user;
   // "getupdates" can also be requests for data of friends of friends
-  user=social_finduser(data);
-  if(!user){return;}
-  struct user* peeruser=social_finduser(peer->id);
-  if(!peeruser){peeruser=user_new(peer->id);}
+  if(!social_finduser(data)){return;}
+  // Don't send old news (based on seq), starting right after what they have
+  struct catchup* catchup=0;
   unsigned int i;
-  for(i=0; i<user->updatecount; ++i)
+  for(i=0; i<catchupcount; ++i)
   {
-    // Check privacy rules
-    if(!social_privacy_check(user, &user->updates[i].privacy, peeruser)){continue;}
-    // Also make sure not to send old news (based on seq)
-    if(user->updates[i].seq<=seq){continue;}
-    sendupdate(peer, user->id, &user->updates[i]);
+    if(!peer_findbyid(catchups[i].peer)){catchup_remove(i); --i; continue;} // Disconnected since
+    if(!memcmp(catchups[i].peer, peer->id, ID_SIZE) && !memcmp(catchups[i].user, data, ID_SIZE)){catchup=&catchups[i];}
+  }
+  if(!catchup)
+  {
+    ++catchupcount;
+    catchups=realloc(catchups, sizeof(struct catchup)*catchupcount);
+    catchup=&catchups[catchupcount-1];
+    memcpy(catchup->peer, peer->id, ID_SIZE);
+    memcpy(catchup->user, data, ID_SIZE);
   }
+  catchup->seq=seq;
+  if(!catchup_send(peer, catchup)){catchup_remove(catchup-catchups);}
 }
 
 static void sendpubkey(struct peer* peer, void* data, unsigned int len)
@@ -269,7 +647,14 @@ void social_init(const char* keypath, const char* pathprefix)
   social_prefix=strdup(pathprefix);
   // Load key, friends, circles, etc. our own profile
   peer_init(keypath);
-  social_self=user_new(peer_id);
+  peer_setdictionary(dictionary, sizeof(dictionary)-1);
+  peer_addcaps(PEER_CAP_UPDATESBATCH);
+  social_update_init();
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if(social_parallelload){user_loadall();}
+  social_self=social_finduser(peer_id);
+  if(!social_self){social_self=user_new(peer_id);}
   if(!social_self->pubkey)
   {
     // Get our own pubkey
@@ -279,9 +664,15 @@ void social_init(const char* keypath, const char* pathprefix)
     user_save(social_self);
     user_load(social_self);
   }
+  unsigned int updates=0;
+  unsigned int i;
+  for(i=0; i<social_usercount; ++i){updates+=social_users[i]->updatecount;}
+  LOG(LOGLEVEL_INFO, "Loaded %u users with %u updates in %.1fms", social_usercount, updates, elapsed(&start)*1000);
   peer_registercmd("updateinfo", updateinfo);
+  peer_registercmd("updatesbatch", updatesbatch);
   peer_registercmd("getpeers", greetpeer);
   peer_registercmd("getupdates", sendupdates);
+  peer_setdrainhandler(catchup_drained);
   peer_registercmd("getpubkey", sendpubkey);
   peer_registercmd("pubkey", receivepubkey);
 // TODO: Set up socket and bootstrap here too? or accept an already set up socket to bootstrap?
@@ -317,14 +708,67 @@ struct friendslist* social_user_getcircle(struct user* user, uint32_t circle)
   return &user->circles[circle];
 }
 
+// Position of the first handle not less than the given one
+static unsigned int circle_find(struct friendslist* c, uint32_t handle)
+{
+  unsigned int low=0;
+  unsigned int high=c->count;
+  while(low<high)
+  {
+    unsigned int mid=(low+high)/2;
+    if(c->friends[mid]<handle){low=mid+1;}else{high=mid;}
+  }
+  return low;
+}
+
+static void viewer_setcircle(struct user* user, uint32_t handle, uint32_t circle, char set)
+{
+  if(!user->viewers){user->viewers=calloc(1, sizeof(struct hashtable));}
+  struct circlemask* mask=hashtable_get(user->viewers, &handle, sizeof(handle));
+  unsigned int word=circle/64;
+  uint64_t bit=(uint64_t)1<<(circle%64);
+  if(!set)
+  {
+    if(!mask || word>=mask->wordcount){return;}
+    mask->bits[word]&=~bit;
+    unsigned int i;
+    for(i=0; i<mask->wordcount && !mask->bits[i]; ++i);
+    if(i==mask->wordcount) // No longer in any circle
+    {
+      hashtable_remove(user->viewers, &handle, sizeof(handle));
+      free(mask);
+    }
+    return;
+  }
+  if(!mask || word>=mask->wordcount)
+  {
+    unsigned int oldcount=(mask?mask->wordcount:0);
+    mask=realloc(mask, sizeof(struct circlemask)+sizeof(uint64_t)*(word+1));
+    memset(&mask->bits[oldcount], 0, sizeof(uint64_t)*(word+1-oldcount));
+    mask->wordcount=word+1;
+    hashtable_set(user->viewers, &handle, sizeof(handle), mask);
+  }
+  mask->bits[word]|=bit;
+}
+
+char social_circle_contains(struct friendslist* circle, struct user* user)
+{
+  unsigned int i=circle_find(circle, user->handle);
+  return i<circle->count && circle->friends[i]==user->handle;
+}
+
 void social_user_addtocircle(struct user* user, uint32_t circle, const unsigned char id[ID_SIZE])
 {
   struct user* friend=social_finduser(id);
   if(!friend){friend=user_new(id);}
   struct friendslist* c=social_user_getcircle(user, circle);
+  unsigned int i=circle_find(c, friend->handle);
+  if(i<c->count && c->friends[i]==friend->handle){return;} // Already in it
   ++c->count;
-  c->friends=realloc(c->friends, sizeof(void*)*c->count);
-  c->friends[c->count-1]=friend;
+  c->friends=realloc(c->friends, sizeof(uint32_t)*c->count);
+  memmove(&c->friends[i+1], &c->friends[i], sizeof(uint32_t)*(c->count-i-1));
+  c->friends[i]=friend->handle;
+  viewer_setcircle(user, friend->handle, circle, 1);
 }
 
 void social_user_removefromcircle(struct user* user, uint32_t circle, const unsigned char id[ID_SIZE])
@@ -332,15 +776,13 @@ void social_user_removefromcircle(struct user* user, uint32_t circle, const unsi
   struct user* friend=social_finduser(id);
   if(!friend){friend=user_new(id);}
   struct friendslist* c=social_user_getcircle(user, circle);
-  unsigned int i;
-  for(i=0; i<c->count; ++i)
+  unsigned int i=circle_find(c, friend->handle);
+  if(i<c->count && c->friends[i]==friend->handle)
   {
-    if(c->friends[i]==friend)
-    {
-      --c->count;
-      memmove(&c->friends[i], &c->friends[i+1], sizeof(void*)*(c->count-i));
-      // TODO: Garbage-collect users who are no longer friends of anyone we know?
-    }
+    --c->count;
+    memmove(&c->friends[i], &c->friends[i+1], sizeof(uint32_t)*(c->count-i));
+    viewer_setcircle(user, friend->handle, circle, 0);
+    // TODO: Garbage-collect users who are no longer friends of anyone we know?
   }
 }
 
@@ -355,6 +797,26 @@ unsigned int social_user_loadmore(struct user* user)
   return user->updatecount-oldcount;
 }
 
+unsigned int social_audit(void)
+{
+  unsigned int failed=0;
+  unsigned int i;
+  for(i=0; i<social_usercount; ++i)
+  {
+    struct user* user=social_users[i];
+    unsigned int j;
+    for(j=0; j<user->updatecount; ++j)
+    {
+      struct update* update=&user->updates[j];
+      if(!update->encoded){continue;}
+      if(social_update_verify(user, update->encoded+ID_SIZE, update->encodedsize-ID_SIZE)){continue;}
+      LOG(LOGLEVEL_WARN, "Update %"PRIu64" of "PEERFMT" failed verification", update->seq, PEERARG(user->id));
+      ++failed;
+    }
+  }
+  return failed;
+}
+
 const char* social_user_getfield(struct user* user, const char* name)
 {
   unsigned int i;
@@ -392,7 +854,7 @@ void social_addfriend(const unsigned char id[ID_SIZE], uint32_t circle)
 // TODO: Send a friend request/notification at some point?
   struct update* update=social_update_getfriend(social_self, circle, id);
   ++social_self->seq;
-  update->seq=social_self->seq;
+  social_update_setseq(social_self, update, social_self->seq);
   update->timestamp=time(0);
   privcpy(update->privacy, social_self->circles[circle].privacy);
   update->friends.add=1;
@@ -410,7 +872,7 @@ void social_removefriend(const unsigned char id[ID_SIZE], uint32_t circle)
   social_user_removefromcircle(social_self, circle, id);
   struct update* update=social_update_getfriend(social_self, circle, id);
   ++social_self->seq;
-  update->seq=social_self->seq;
+  social_update_setseq(social_self, update, social_self->seq);
   update->type=UPDATE_FRIENDS;
   update->timestamp=time(0);
   privcpy(update->privacy, social_self->circles[circle].privacy);
@@ -425,7 +887,7 @@ void social_createpost(const char* msg, struct privacy* privacy)
   // TODO: Posts attached to users and/or users' updates
   struct update* post=social_update_new(social_self);
   ++social_self->seq;
-  post->seq=social_self->seq;
+  social_update_setseq(social_self, post, social_self->seq);
   post->type=UPDATE_POST;
   post->timestamp=time(0);
   privcpy(post->privacy, *privacy);
@@ -439,7 +901,7 @@ void social_updatefield(const char* name, const char* value, struct privacy* pri
 {
   struct update* post=social_update_getfield(social_self, name);
   ++social_self->seq;
-  post->seq=social_self->seq;
+  social_update_setseq(social_self, post, social_self->seq);
   post->timestamp=time(0);
   privcpy(post->privacy, *privacy);
   post->field.value=strdup(value);
@@ -450,17 +912,15 @@ void social_updatefield(const char* name, const char* value, struct privacy* pri
 
 struct user* social_finduser(const unsigned char id[ID_SIZE])
 {
-  unsigned int i;
-  for(i=0; i<social_usercount; ++i)
-  {
-    if(!memcmp(social_users[i]->id, id, ID_SIZE)){return social_users[i];}
-  }
-  return 0;
+  return hashtable_get(&usersbyid, id, ID_SIZE);
 }
 
-void social_shareupdate(struct update* update)
+unsigned int social_shareupdate(struct update* update)
 {
-  // Send update to anyone who is currently online and which the update's privacy settings allow
+  // Send update to anyone who is currently online and which the update's privacy settings allow, once each even if they're in several circles
+  unsigned char* seen=calloc((social_usercount+7)/8, 1);
+  struct peer** audience=0;
+  unsigned int count=0;
   unsigned int i;
   for(i=0; i<social_self->circlecount; ++i)
   {
@@ -468,42 +928,53 @@ void social_shareupdate(struct update* update)
     unsigned int i2;
     for(i2=0; i2<c->count; ++i2)
     {
+      uint32_t handle=c->friends[i2];
+      if(seen[handle/8]&(1<<(handle%8))){continue;}
+      seen[handle/8]|=1<<(handle%8);
+      struct user* friend=social_users[handle];
+      if(!friend->peer){continue;}
       // Check privacy setting
-      if(!social_privacy_check(social_self, &update->privacy, c->friends[i2])){continue;}
-      if(c->friends[i2]->peer)
-      {
-        sendupdate(c->friends[i2]->peer, social_self->id, update);
-      }
+      if(!social_privacy_check(social_self, &update->privacy, friend)){continue;}
+      ++count;
+      audience=realloc(audience, sizeof(void*)*count);
+      audience[count-1]=friend->peer;
     }
   }
+  free(seen);
+  for(i=0; i<count; ++i)
+  {
+    sendupdate(audience[i], update, PEER_PRIORITY_INTERACTIVE);
+  }
+  free(audience);
+  return count;
 }
 
-char social_privacy_check(struct user* origin, struct privacy* privacy, struct user* user)
+const struct circlemask* social_user_circlemask(struct user* origin, struct user* viewer)
+{
+  if(!origin->viewers){return 0;}
+  return hashtable_get(origin->viewers, &viewer->handle, sizeof(viewer->handle));
+}
+
+char social_privacy_checkmask(struct privacy* privacy, const struct circlemask* mask)
 {
   if(privacy->flags&PRIVACY_ANYONE){return 1;}
-  unsigned int i, i2;
-  if(privacy->flags&PRIVACY_FRIENDS)
-  {
-    for(i=0; i<origin->circlecount; ++i)
-    {
-      for(i2=0; i2<origin->circles[i].count; ++i2)
-      {
-        if(origin->circles[i].friends[i2]==user){return 1;}
-      }
-    }
-  }
+  if(!mask){return 0;} // Not in any circle
+  if(privacy->flags&PRIVACY_FRIENDS){return 1;}
+  unsigned int i;
   for(i=0; i<privacy->circlecount; ++i)
   {
-    if(privacy->circles[i]>=origin->circlecount){continue;}
-    struct friendslist* circle=&origin->circles[privacy->circles[i]];
-    for(i2=0; i2<circle->count; ++i2)
-    {
-      if(circle->friends[i2]==user){return 1;}
-    }
+    uint32_t word=privacy->circles[i]/64;
+    if(word<mask->wordcount && (mask->bits[word]&((uint64_t)1<<(privacy->circles[i]%64)))){return 1;}
   }
   return 0;
 }
 
+char social_privacy_check(struct user* origin, struct privacy* privacy, struct user* user)
+{
+  if(privacy->flags&PRIVACY_ANYONE){return 1;}
+  return social_privacy_checkmask(privacy, social_user_circlemask(origin, user));
+}
+
 void social_setcircle(uint32_t circle, const char* name, struct privacy* privacy)
 {
   struct friendslist* c=social_user_getcircle(social_self, circle);
@@ -514,7 +985,7 @@ void social_setcircle(uint32_t circle, const char* name, struct privacy* privacy
   struct update* update=social_update_getcircle(social_self, circle);
   free((void*)update->circle.name);
   ++social_self->seq;
-  update->seq=social_self->seq;
+  social_update_setseq(social_self, update, social_self->seq);
   update->timestamp=time(0);
   // TODO: Is there any situation where we would want this update to be public?
   update->circle.circle=circle;
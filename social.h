@@ -41,24 +41,52 @@ struct privacy
   (dst).circles=malloc(sizeof(uint32_t)*(dst).circlecount); \
   memcpy((dst).circles, (src).circles, sizeof(uint32_t)*(dst).circlecount)
 
+struct hashtable;
+struct seqindex;
+
+/**
+* circlemask:
+* @wordcount: Number of words in @bits
+* @bits: Bit n (of word n/64) is set if the viewer is in circle n
+*
+* Which of a user's circles another user is in, see social_user_circlemask()
+*/
+struct circlemask
+{
+  unsigned int wordcount;
+  uint64_t bits[];
+};
+
+/**
+* friendslist:
+* @name: What to call this circle of friends
+* @privacy: Privacy setting to use for additions and removals from this circle
+* @friends: Handles of the users in the circle, in ascending order, see social_users
+* @count: Number of users in the circle
+*
+* A circle of friends
+*/
 struct friendslist
 {
-  char* name; // What to call this circle of friends
-  struct privacy privacy; // Privacy setting to use for additions and removals from this circle
-  struct user** friends;
+  char* name;
+  struct privacy privacy;
+  uint32_t* friends;
   unsigned int count;
 };
 
 /**
 * user:
 * @id: Peer ID
+* @handle: Index of the user in social_users, used in place of the ID for compact sets of users
 * @pubkey: Public key
 * @peer: Peer structure, or NULL if they are not connected
 * @circles: Friend circles
 * @circlecount: Number of friend circles
+* @viewers: #circlemask of each user in any of the circles, by handle
 * @seq: Sequence number of the last received (and confirmed) update
 * @updates: Updates
 * @updatecount: Number of updates
+* @seqindex: Updates ordered and looked up by sequence number, see social_update_setseq()
 * @rotation: Current number of rotating update files loaded
 * @rotationcount: Total number of rotating update files for this user
 *
@@ -67,18 +95,41 @@ struct friendslist
 struct user
 {
   unsigned char id[ID_SIZE];
+  uint32_t handle;
   gnutls_pubkey_t pubkey;
   struct peer* peer;
   struct friendslist* circles;
   unsigned int circlecount;
+  struct hashtable* viewers;
   uint64_t seq; // Sequence of updates we have from this user. 64 bits should be enough for a lifetime of updates (18446744073709551616 updates, enough to update 584 times per millisecond for a million years)
   struct update* updates;
   unsigned int updatecount;
+  struct seqindex* seqindex;
   unsigned int rotation;
   unsigned int rotationcount;
 };
 
-extern struct user** social_users;
+/**
+* socialstats:
+* @verificationsavoided: Number of received or loaded updates turned away as duplicates or superseded before verifying their signatures
+* @trustedloads: Number of updates loaded from our own store without verifying their signatures again, on the strength of the store's MAC
+*
+* Counters for the social layer, see #social_stats
+*/
+struct socialstats
+{
+  uint64_t verificationsavoided;
+  uint64_t trustedloads;
+};
+
+extern struct socialstats social_stats;
+/**
+* social_parallelload:
+*
+* Set before calling social_init() to find every user with a stored public key up front and read and verify their updates in parallel on the thread pool, instead of loading users one by one as they come up
+*/
+extern char social_parallelload;
+extern struct user** social_users; // Users are never removed, so a user's handle stays valid
 extern unsigned int social_usercount;
 extern struct user* social_self; // Most things we need to keep track of for ourself are the same things we need to keep track of for others
 extern char* social_prefix;
@@ -94,6 +145,15 @@ extern struct friendslist* social_user_getcircle(struct user* user, uint32_t cir
 extern void social_user_addtocircle(struct user* user, uint32_t circle, const unsigned char id[ID_SIZE]);
 extern void social_user_removefromcircle(struct user* user, uint32_t circle, const unsigned char id[ID_SIZE]);
 /**
+* social_circle_contains:
+* @circle: Circle of friends
+* @user: User to look for
+*
+* Check if a user is in a circle
+* Returns: 1 if @user is in @circle, otherwise 0
+*/
+extern char social_circle_contains(struct friendslist* circle, struct user* user);
+/**
 * social_user_loadmore:
 * @user: User to load more updates for
 *
@@ -130,9 +190,50 @@ extern void social_createpost(const char* msg, struct privacy* privacy);
 */
 extern void social_updatefield(const char* name, const char* value, struct privacy* privacy);
 extern struct user* social_finduser(const unsigned char id[ID_SIZE]);
-extern void social_shareupdate(struct update* update);
+/**
+* social_audit:
+*
+* Verify the signatures of all loaded updates again, regardless of them having been verified when we got them
+* Returns: Number of updates that failed verification
+*/
+extern unsigned int social_audit(void);
+/**
+* social_shareupdate:
+* @update: One of our own updates
+*
+* Send an update to every connected friend its privacy setting allows, once each
+* Returns: The number of peers it was sent to
+*/
+extern unsigned int social_shareupdate(struct update* update);
+/**
+* social_privacy_check:
+* @origin: User whose privacy setting it is
+* @privacy: Privacy setting
+* @user: User who wants to see it
+*
+* Check if a privacy setting lets a user see something
+* Returns: 1 if @user may see it, otherwise 0
+*/
 extern char social_privacy_check(struct user* origin, struct privacy* privacy, struct user* user);
 /**
+* social_user_circlemask:
+* @origin: User whose circles to check
+* @viewer: User to look for in the circles
+*
+* Get which of @origin's circles @viewer is in, to check several privacy settings with social_privacy_checkmask() at once
+* Returns: The circles, or NULL if @viewer is in none of them
+*/
+extern const struct circlemask* social_user_circlemask(struct user* origin, struct user* viewer);
+/**
+* social_privacy_checkmask:
+* @privacy: Privacy setting
+* @mask: The viewer's circles from social_user_circlemask(), may be NULL
+*
+* Like social_privacy_check() but with the viewer's circles looked up already
+* Returns: 1 if the viewer may see it, otherwise 0
+*/
+extern char social_privacy_checkmask(struct privacy* privacy, const struct circlemask* mask);
+/**
 * social_setcircle:
 * @circle: Circle ID
 * @name: New name for the circle
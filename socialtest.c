@@ -15,6 +15,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <string.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -23,6 +24,9 @@
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include "peer.h"
+#include "peercache.h"
+#include "threadpool.h"
+#include "log.h"
 #include "social.h"
 #include "update.h"
 
@@ -67,6 +71,12 @@ struct user* finduser(const char* search) // Find user by just the beginnig (or
   return 0;
 }
 
+void bootstrapped(unsigned int count, void* data)
+{
+  (void)data;
+  printf("\r  \rBootstrap: connecting to %u peers\n", count);
+}
+
 int main(int argc, char** argv)
 {
   int sock=socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -77,10 +87,12 @@ int main(int argc, char** argv)
     bind(sock, ai->ai_addr, ai->ai_addrlen);
     freeaddrinfo(ai);
   }
+  if(argc>2 && !strcmp(argv[2], "parallel")){social_parallelload=1;}
   social_init("priv.pem", ".");
-  peer_bootstrap(sock, "127.0.0.1:4000");
+  peercache_load("peers.cache");
+  if(!peercache_bootstrap(sock, 8)){peer_bootstrap_async(sock, "127.0.0.1:4000", bootstrapped, 0);}
 
-  struct pollfd pfd[]={{.fd=0, .events=POLLIN, .revents=0}, {.fd=sock, .events=POLLIN, .revents=0}};
+  struct pollfd pfd[]={{.fd=0, .events=POLLIN, .revents=0}, {.fd=sock, .events=POLLIN, .revents=0}, {.fd=threadpool_fd(), .events=POLLIN, .revents=0}};
   char buf[1024];
   struct privacy privacy={.flags=PRIVACY_FRIENDS, .circles=0, .circlecount=0};
   unsigned int i;
@@ -88,7 +100,12 @@ int main(int argc, char** argv)
   {
     printf("> ");
     fflush(stdout);
-    poll(pfd, 2, -1);
+    if(!poll(pfd, 3, peer_flushtimeout())) // Bandwidth limits allow sending more
+    {
+      printf("\r  \r");
+      peer_flush();
+      continue;
+    }
     if(pfd[0].revents) // stdin
     {
       pfd[0].revents=0;
@@ -187,6 +204,11 @@ int main(int argc, char** argv)
       {
         peer_exportpeers(&buf[12]);
       }
+      else if(!strcmp(buf, "savepeers"))
+      {
+        peercache_save();
+      }
+      else if(!strcmp(buf, "quit")){break;}
       else if(!strcmp(buf, "lscircles"))
       {
         for(i=0; i<social_self->circlecount; ++i)
@@ -198,7 +220,7 @@ int main(int argc, char** argv)
           unsigned int i2;
           for(i2=0; i2<circle->count; ++i2)
           {
-            printf("  "PEERFMT"\n", PEERARG(circle->friends[i2]->id));
+            printf("  "PEERFMT"\n", PEERARG(social_users[circle->friends[i2]]->id));
           }
         }
       }
@@ -256,7 +278,42 @@ int main(int argc, char** argv)
       }
       else if(!strncmp(buf, "bootstrap ", 10))
       {
-        peer_bootstrap(sock, &buf[10]);
+        peer_bootstrap_async(sock, &buf[10], bootstrapped, 0);
+      }
+      else if(!strncmp(buf, "loglevel ", 9))
+      {
+        log_level=atoi(&buf[9]);
+      }
+      else if(!strncmp(buf, "bandwidth ", 10))
+      {
+        char* total=strchr(&buf[10], ' ');
+        peer_setbandwidth(atoi(&buf[10]), total?atoi(total):0);
+      }
+      else if(!strcmp(buf, "stats"))
+      {
+        printf("Handshakes: %u full, %u resumed, %"PRIu64" rejected\n", peer_stats.fullhandshakes, peer_stats.resumedhandshakes, peer_stats.rejectedhandshakes);
+        printf("Deferred commands: %"PRIu64", dropped: %"PRIu64"\n", peer_stats.deferredcmds, peer_stats.droppedcmds);
+        printf("Compression: %"PRIu64" bytes sent as %"PRIu64", %"PRIu64" bytes received as %"PRIu64"\n", peer_stats.deflatedin, peer_stats.deflatedout, peer_stats.inflatedout, peer_stats.inflatedin);
+        printf("Verifications avoided: %"PRIu64", loaded without verifying: %"PRIu64"\n", social_stats.verificationsavoided, social_stats.trustedloads);
+        const char* cmd;
+        for(i=0; (cmd=peer_listcmds(i)); ++i)
+        {
+          struct peer_cmdstats* stats=peer_getcmdstats(cmd);
+          printf("%-16s received %"PRIu64" (%"PRIu64" bytes), sent %"PRIu64" (%"PRIu64" bytes), handler time:", cmd, stats->received, stats->bytesin, stats->sent, stats->bytesout);
+          unsigned int bucket;
+          for(bucket=0; bucket<PEER_CMDSTATS_BUCKETS; ++bucket){printf(" %"PRIu64, stats->handlertime[bucket]);}
+          printf("\n");
+        }
+        for(i=0; i<social_usercount; ++i)
+        {
+          struct peer* peer=social_users[i]->peer;
+          if(!peer){continue;}
+          printf(PEERFMT" received %"PRIu64" bytes, sent %"PRIu64" bytes, %u bytes queued\n", PEERARG(peer->id), peer->bytesin, peer->bytesout, peer->queued);
+        }
+      }
+      else if(!strcmp(buf, "audit"))
+      {
+        printf("%u updates failed verification\n", social_audit());
       }
       else if(!strcmp(buf, "whoami"))
       {
@@ -280,13 +337,19 @@ int main(int argc, char** argv)
                "update post\n"
                "update field <name>\n"
                "exportpeers <filename>\n"
+               "savepeers (save the peer cache now)\n"
                "lscircles\n"
                "privacy\n"
                "privacy flag \n"
                "privacy circle \n"
                "setcircle <circle ID>\n"
                "bootstrap <host>:<port>\n"
-               "whoami\n");
+               "loglevel <0-3> (errors, warnings, info, debug)\n"
+               "bandwidth <bytes/s per peer> [<bytes/s total>] (0 for unlimited)\n"
+               "stats\n"
+               "audit (verify all loaded updates again)\n"
+               "whoami\n"
+               "quit\n");
       }
       else{printf("Unknown command '%s'\n", buf);}
     }
@@ -299,6 +362,12 @@ int main(int argc, char** argv)
       peer_handlesocket(sock);
 // TODO: Notify of updates as they happen
     }
+    if(pfd[2].revents) // Finished background work
+    {
+      pfd[2].revents=0;
+      threadpool_handle();
+    }
   }
+  peercache_save();
   return 0;
 }
@@ -0,0 +1,122 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "threadpool.h"
+#define MIN_THREADS 4 // Enough that a few slow DNS lookups don't hold up everything else
+
+struct job
+{
+  void(*work)(void*);
+  void(*done)(void*);
+  void* data;
+  struct job* next;
+};
+
+static pthread_mutex_t mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond=PTHREAD_COND_INITIALIZER;
+static struct job* queue=0;
+static struct job** queueend=&queue;
+static struct job* finished=0;
+static struct job** finishedend=&finished;
+static int notify[2]={-1,-1};
+
+static void* worker(void* x)
+{
+  (void)x;
+  pthread_mutex_lock(&mutex);
+  while(1)
+  {
+    while(!queue){pthread_cond_wait(&cond, &mutex);}
+    struct job* job=queue;
+    queue=job->next;
+    if(!queue){queueend=&queue;}
+    pthread_mutex_unlock(&mutex);
+    job->work(job->data);
+    pthread_mutex_lock(&mutex);
+    job->next=0;
+    *finishedend=job;
+    finishedend=&job->next;
+    // If the pipe is full the event loop has wakeups pending already
+    if(write(notify[1], "", 1)){}
+  }
+  return 0;
+}
+
+void threadpool_init(unsigned int threads)
+{
+  if(notify[0]>=0){return;}
+  if(!threads)
+  {
+    long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+    threads=(cpus>MIN_THREADS?cpus:MIN_THREADS);
+  }
+  if(pipe(notify)){return;}
+  fcntl(notify[0], F_SETFL, O_NONBLOCK);
+  fcntl(notify[1], F_SETFL, O_NONBLOCK);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  unsigned int i;
+  for(i=0; i<threads; ++i)
+  {
+    pthread_t thread;
+    pthread_create(&thread, &attr, worker, 0);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void threadpool_run(void(*work)(void*), void(*done)(void*), void* data)
+{
+  threadpool_init(0);
+  struct job* job=malloc(sizeof(struct job));
+  job->work=work;
+  job->done=done;
+  job->data=data;
+  job->next=0;
+  pthread_mutex_lock(&mutex);
+  *queueend=job;
+  queueend=&job->next;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+int threadpool_fd(void)
+{
+  threadpool_init(0);
+  return notify[0];
+}
+
+void threadpool_handle(void)
+{
+  char buf[64];
+  while(read(notify[0], buf, sizeof(buf))>0);
+  pthread_mutex_lock(&mutex);
+  struct job* job=finished;
+  finished=0;
+  finishedend=&finished;
+  pthread_mutex_unlock(&mutex);
+  while(job)
+  {
+    struct job* next=job->next;
+    if(job->done){job->done(job->data);}
+    free(job);
+    job=next;
+  }
+}
@@ -0,0 +1,55 @@
+/*
+    peer, a peer-to-peer foundation
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+* SECTION:threadpool
+* @title: Thread pool
+* @short_description: Runs slow work off the network thread
+*
+* Worker threads for blocking or expensive operations (name resolution, public key crypto), whose results are handed back to the event loop through a file descriptor
+*/
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+/**
+* threadpool_init:
+* @threads: Number of worker threads, or 0 for a default based on the number of CPUs
+*
+* Start the worker threads, called automatically with the default if work is queued before it's called
+*/
+extern void threadpool_init(unsigned int threads);
+/**
+* threadpool_run:
+* @work: Function to run on a worker thread
+* @done: Function to run on the event loop thread once @work is done, called from threadpool_handle(), may be NULL
+* @data: Argument for @work and @done
+*
+* Queue work for the worker threads
+*/
+extern void threadpool_run(void(*work)(void*), void(*done)(void*), void* data);
+/**
+* threadpool_fd:
+*
+* Get a file descriptor that becomes readable when finished work is waiting for threadpool_handle(), for use with poll() and similar
+* Returns: The file descriptor
+*/
+extern int threadpool_fd(void);
+/**
+* threadpool_handle:
+*
+* Run the completion callbacks of finished work
+*/
+extern void threadpool_handle(void);
+#endif
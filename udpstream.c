@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/socket.h>
+#include <pthread.h>
 #include "udpstream.h"
 
 #define TYPE_PAYLOAD 0
@@ -32,6 +33,8 @@
 #define TYPE_PING    6
 #define TYPE_PONG    7
 #define TYPE_RESET   8
+#define RESEND_TIMEOUT 1.0 // Seconds before an unacknowledged packet is sent again
+#define RESEND_INTERVAL 0.2 // Least seconds between resends on request, every packet after a gap asks for it again
 #define HEADERSIZE (sizeof(uint32_t)+sizeof(uint16_t)+sizeof(uint8_t))
 // TODO: Handle stale connections, disconnects, maybe a connect message type?
 
@@ -40,6 +43,7 @@ struct packet
   uint16_t seq;
   char* buf;
   unsigned int buflen;
+  double sent; // When a sent packet was last (re)sent
 };
 
 #define STATE_INIT    1
@@ -61,11 +65,32 @@ struct udpstream
   unsigned int buflen;
   unsigned char state;
   time_t timestamp;
-// TODO: add void pointer to keep relevant application data? plus a function to free it if the connection is closed or abandoned as stale
+  void* data; // Application data, e.g. the peer using the stream
+  char held; // Skipped by udpstream_poll()
+// TODO: function to free data if the connection is closed or abandoned as stale?
 };
 
 static struct udpstream** streams=0;
 static unsigned int streamcount=0;
+// Streams may be read and written from worker threads (e.g. TLS handshakes) while the event loop handles the socket
+static pthread_mutex_t lock;
+static pthread_once_t lockonce=PTHREAD_ONCE_INIT;
+
+static void lock_init(void)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+static void stream_lock(void)
+{
+  pthread_once(&lockonce, lock_init);
+  pthread_mutex_lock(&lock);
+}
+#define stream_unlock() pthread_mutex_unlock(&lock)
 
 static struct udpstream* stream_new(int sock, struct sockaddr_storage* addr, socklen_t addrlen)
 {
@@ -83,13 +108,15 @@ static struct udpstream* stream_new(int sock, struct sockaddr_storage* addr, soc
   stream->buflen=0;
   stream->state=0; // Start new streams as invalid, need to init
   stream->timestamp=time(0);
+  stream->data=0;
+  stream->held=0;
   ++streamcount;
   streams=realloc(streams, sizeof(void*)*streamcount);
   streams[streamcount-1]=stream;
   return stream;
 }
 
-struct udpstream* udpstream_find(struct sockaddr_storage* addr, socklen_t addrlen)
+static struct udpstream* stream_find(struct sockaddr_storage* addr, socklen_t addrlen)
 {
   unsigned int i;
   for(i=0; i<streamcount; ++i)
@@ -102,6 +129,13 @@ struct udpstream* udpstream_find(struct sockaddr_storage* addr, socklen_t addrle
   return 0;
 }
 
+static double monotime(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec+now.tv_nsec/1000000000.0;
+}
+
 static ssize_t stream_send(struct udpstream* stream, uint8_t type, uint16_t seq, uint32_t size, const void* buf)
 {
 // TODO: Include a checksum in the header?
@@ -165,20 +199,22 @@ static void stream_free(struct udpstream* stream)
 
 struct udpstream* udpstream_new(int sock, struct sockaddr_storage* addr, socklen_t addrlen)
 {
+  stream_lock();
   struct udpstream* stream=stream_new(sock, addr, addrlen);
   stream->state=STATE_INIT; // If we're creating the stream we're the ones initializing it
   stream_send(stream, TYPE_INIT, 0, 0, 0);
+  stream_unlock();
   return stream;
 }
 
-void udpstream_readsocket(int sock)
+static void stream_readsocket(int sock)
 {
   time_t now=time(0);
-  char buf[1024];
+  char buf[65536]; // Large enough for any datagram, a truncated packet would corrupt the stream
   struct sockaddr_storage addr;
   socklen_t addrlen=sizeof(addr);
-  ssize_t len=recvfrom(sock, buf, 1024, 0, (struct sockaddr*)&addr, &addrlen);
-  struct udpstream* stream=udpstream_find(&addr, addrlen);
+  ssize_t len=recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&addr, &addrlen);
+  struct udpstream* stream=stream_find(&addr, addrlen);
   if(!stream){stream=stream_new(sock, &addr, addrlen);}
   stream->buflen+=len;
   stream->buf=realloc(stream->buf, stream->buflen);
@@ -213,7 +249,12 @@ void udpstream_readsocket(int sock)
       stream_free(stream);
       return;
     }
-    if((stream->state&STATE_CLOSING) && type!=TYPE_CLOSED){return;}
+    if((stream->state&STATE_CLOSING) && type!=TYPE_CLOSED && type!=TYPE_CLOSE)
+    { // Ignore anything else once we're closing
+      stream->buflen-=(payloadsize+HEADERSIZE);
+      memmove(stream->buf, stream->buf+HEADERSIZE+payloadsize, stream->buflen);
+      continue;
+    }
     switch(type)
     {
     case TYPE_ACK: // Handle acknowledgement of sent packet
@@ -228,7 +269,7 @@ void udpstream_readsocket(int sock)
           {
             free(stream->sentpackets[i].buf);
             --stream->sentpacketcount;
-            memmove(&stream->sentpackets[i], &stream->sentpackets[i+1], sizeof(struct packet)*stream->sentpacketcount);
+            memmove(&stream->sentpackets[i], &stream->sentpackets[i+1], sizeof(struct packet)*(stream->sentpacketcount-i));
             --i;
           }
         }
@@ -238,24 +279,50 @@ void udpstream_readsocket(int sock)
       stream->buflen-=(payloadsize+HEADERSIZE);
       memmove(stream->buf, stream->buf+HEADERSIZE+payloadsize, stream->buflen);
       break;
-    case TYPE_RESEND: // TODO: Handle request to resend packets not received by the peer
-fprintf(stderr, "TODO: resend packets\n");
+    case TYPE_RESEND: // Resend packets the peer is missing, if they're still waiting for acknowledgement
+      {
+        double resendtime=monotime();
+        unsigned int i;
+        for(i=0; i+sizeof(uint16_t)<=payloadsize; i+=sizeof(uint16_t))
+        {
+          memcpy(&seq, stream->buf+HEADERSIZE+i, sizeof(uint16_t));
+          unsigned int i2;
+          for(i2=0; i2<stream->sentpacketcount; ++i2)
+          {
+            struct packet* packet=&stream->sentpackets[i2];
+            if(packet->seq!=seq){continue;}
+            if(packet->sent+RESEND_INTERVAL>resendtime){break;}
+            stream_send(stream, TYPE_PAYLOAD, packet->seq, packet->buflen, packet->buf);
+            packet->sent=resendtime;
+            break;
+          }
+        }
+      }
       stream->buflen-=(payloadsize+HEADERSIZE);
       memmove(stream->buf, stream->buf+HEADERSIZE+payloadsize, stream->buflen);
       break;
     case TYPE_PAYLOAD:
+      {
       // Send ack, regardless of whether it's in the right order
       stream_send(stream, TYPE_ACK, 0, sizeof(uint16_t), &seq);
-      // Add to list of parsed packets
-      ++stream->recvpacketcount;
-      stream->recvpackets=realloc(stream->recvpackets, sizeof(struct packet)*stream->recvpacketcount);
-      stream->recvpackets[stream->recvpacketcount-1].seq=seq;
-      stream->recvpackets[stream->recvpacketcount-1].buf=malloc(payloadsize);
-      stream->recvpackets[stream->recvpacketcount-1].buflen=payloadsize;
-      memcpy(stream->recvpackets[stream->recvpacketcount-1].buf, stream->buf+HEADERSIZE, payloadsize);
+      // Skip copies of packets we already have or have already read, resent after a lost ack
+      char duplicate=((uint16_t)(seq-stream->inseq)>=0x8000);
+      unsigned int i;
+      for(i=0; !duplicate && i<stream->recvpacketcount; ++i){duplicate=(stream->recvpackets[i].seq==seq);}
+      if(!duplicate)
+      {
+        // Add to list of parsed packets
+        ++stream->recvpacketcount;
+        stream->recvpackets=realloc(stream->recvpackets, sizeof(struct packet)*stream->recvpacketcount);
+        stream->recvpackets[stream->recvpacketcount-1].seq=seq;
+        stream->recvpackets[stream->recvpacketcount-1].buf=malloc(payloadsize);
+        stream->recvpackets[stream->recvpacketcount-1].buflen=payloadsize;
+        memcpy(stream->recvpackets[stream->recvpacketcount-1].buf, stream->buf+HEADERSIZE, payloadsize);
+      }
       stream->buflen-=(payloadsize+HEADERSIZE);
       memmove(stream->buf, stream->buf+HEADERSIZE+payloadsize, stream->buflen);
-      udpstream_requestresend(stream, seq); // Ask to resend if we're missing any packets
+      if(!duplicate){udpstream_requestresend(stream, seq);} // Ask to resend if we're missing any packets
+      }
       break;
     case TYPE_INIT: // Should be at the start of each connection and must have sequence 0, size 0
 // TODO: If we receive a valid init for an already initialized stream, invalidate the old one (memset ->addr? plus STATE_CLOSED) and create a new stream to indicate a new connection?
@@ -276,8 +343,15 @@ fprintf(stderr, "TODO: resend packets\n");
       memmove(stream->buf, stream->buf+HEADERSIZE+payloadsize, stream->buflen);
       break;
     case TYPE_CLOSE: // Requesting to close the stream
-      stream->state|=STATE_CLOSED;
       stream_send(stream, TYPE_CLOSED, 0, 0, 0);
+      if(stream->state&STATE_CLOSING) // Both sides closed at the same time
+      {
+        stream_free(stream);
+        return;
+      }
+      stream->state|=STATE_CLOSED;
+      stream->buflen-=(payloadsize+HEADERSIZE);
+      memmove(stream->buf, stream->buf+HEADERSIZE+payloadsize, stream->buflen);
       break;
     case TYPE_CLOSED: // Confirming stream closure
       if(stream->state&STATE_CLOSING)
@@ -285,6 +359,8 @@ fprintf(stderr, "TODO: resend packets\n");
         stream_free(stream);
         return;
       }
+      stream->buflen-=(payloadsize+HEADERSIZE);
+      memmove(stream->buf, stream->buf+HEADERSIZE+payloadsize, stream->buflen);
       break;
     case TYPE_PING:
       stream_send(stream, TYPE_PONG, 0, 0, 0);
@@ -297,17 +373,38 @@ fprintf(stderr, "TODO: resend packets\n");
   }
 }
 
-struct udpstream* udpstream_poll(void)
+// Send packets again that haven't been acknowledged in time, for lost packets the peer can't ask for because nothing after them arrived
+static void stream_resend(void)
+{
+  double now=monotime();
+  unsigned int i;
+  for(i=0; i<streamcount; ++i)
+  {
+    if(streams[i]->state&STATE_CLOSED){continue;}
+    unsigned int i2;
+    for(i2=0; i2<streams[i]->sentpacketcount; ++i2)
+    {
+      struct packet* packet=&streams[i]->sentpackets[i2];
+      if(packet->sent+RESEND_TIMEOUT>now){continue;}
+      stream_send(streams[i], TYPE_PAYLOAD, packet->seq, packet->buflen, packet->buf);
+      packet->sent=now;
+    }
+  }
+}
+
+static struct udpstream* stream_poll(void)
 {
   time_t now=time(0);
+  stream_resend();
   unsigned int i;
   for(i=0; i<streamcount; ++i)
   {
+    if(streams[i]->held){continue;}
     // Check for state changes
     if(streams[i]->state&STATE_CLOSED){return streams[i];}
-    // Check for the next packet in the order
+    // Check for the next packet in the order, unless the application already closed the stream
     unsigned int i2;
-    for(i2=0; i2<streams[i]->recvpacketcount; ++i2)
+    for(i2=0; !(streams[i]->state&STATE_CLOSING) && i2<streams[i]->recvpacketcount; ++i2)
     {
       if(streams[i]->recvpackets[i2].seq==streams[i]->inseq){return streams[i];}
     }
@@ -332,7 +429,7 @@ struct udpstream* udpstream_poll(void)
   return 0;
 }
 
-ssize_t udpstream_read(struct udpstream* stream, void* buf, size_t size)
+static ssize_t stream_read(struct udpstream* stream, void* buf, size_t size)
 {
   if(stream->state&(STATE_CLOSED|STATE_CLOSING)){return 0;} // EOF, TODO: -1 and EBADFD for STATE_CLOSING?
   // Check if it's any previously out of order packet's turn now
@@ -352,7 +449,7 @@ ssize_t udpstream_read(struct udpstream* stream, void* buf, size_t size)
         memcpy(buf, stream->recvpackets[i].buf, len);
         free(stream->recvpackets[i].buf);
         --stream->recvpacketcount;
-        memmove(&stream->recvpackets[i], &stream->recvpackets[i+1], sizeof(struct packet)*stream->recvpacketcount);
+        memmove(&stream->recvpackets[i], &stream->recvpackets[i+1], sizeof(struct packet)*(stream->recvpacketcount-i));
         ++stream->inseq;
         return len;
       }
@@ -363,7 +460,7 @@ ssize_t udpstream_read(struct udpstream* stream, void* buf, size_t size)
   return -1;
 }
 
-ssize_t udpstream_write(struct udpstream* stream, const void* buf, size_t size)
+static ssize_t stream_write(struct udpstream* stream, const void* buf, size_t size)
 {
   if(stream->state&(STATE_CLOSED|STATE_CLOSING)){return 0;} // EOF, TODO: -1 and EBADFD for STATE_CLOSING?
 // TODO: abort and return negative if sentpacketcount is too high? EWOULDBLOCK?
@@ -372,12 +469,52 @@ ssize_t udpstream_write(struct udpstream* stream, const void* buf, size_t size)
   stream->sentpackets[stream->sentpacketcount-1].seq=stream->outseq;
   stream->sentpackets[stream->sentpacketcount-1].buf=malloc(size);
   stream->sentpackets[stream->sentpacketcount-1].buflen=size;
+  stream->sentpackets[stream->sentpacketcount-1].sent=monotime();
   memcpy(stream->sentpackets[stream->sentpacketcount-1].buf, buf, size);
   stream_send(stream, TYPE_PAYLOAD, stream->outseq, size, buf);
   ++stream->outseq;
   return size;
 }
 
+struct udpstream* udpstream_find(struct sockaddr_storage* addr, socklen_t addrlen)
+{
+  stream_lock();
+  struct udpstream* stream=stream_find(addr, addrlen);
+  stream_unlock();
+  return stream;
+}
+
+void udpstream_readsocket(int sock)
+{
+  stream_lock();
+  stream_readsocket(sock);
+  stream_unlock();
+}
+
+struct udpstream* udpstream_poll(void)
+{
+  stream_lock();
+  struct udpstream* stream=stream_poll();
+  stream_unlock();
+  return stream;
+}
+
+ssize_t udpstream_read(struct udpstream* stream, void* buf, size_t size)
+{
+  stream_lock();
+  ssize_t r=stream_read(stream, buf, size);
+  stream_unlock();
+  return r;
+}
+
+ssize_t udpstream_write(struct udpstream* stream, const void* buf, size_t size)
+{
+  stream_lock();
+  ssize_t r=stream_write(stream, buf, size);
+  stream_unlock();
+  return r;
+}
+
 void udpstream_getaddr(struct udpstream* stream, struct sockaddr_storage* addr, socklen_t* addrlen)
 {
   if(*addrlen>stream->addrlen){*addrlen=stream->addrlen;}
@@ -386,7 +523,60 @@ void udpstream_getaddr(struct udpstream* stream, struct sockaddr_storage* addr,
 
 int udpstream_getsocket(struct udpstream* stream){return stream->sock;}
 
-void udpstream_close(struct udpstream* stream)
+void udpstream_setdata(struct udpstream* stream, void* data){stream->data=data;}
+
+void* udpstream_getdata(struct udpstream* stream){return stream->data;}
+
+unsigned int udpstream_unacked(struct udpstream* stream)
+{
+  double now=monotime();
+  stream_lock();
+  unsigned int count=0;
+  unsigned int i;
+  for(i=0; i<stream->sentpacketcount; ++i)
+  {
+    if(stream->sentpackets[i].sent+RESEND_TIMEOUT>now){++count;}
+  }
+  stream_unlock();
+  return count;
+}
+
+void udpstream_resend(void)
+{
+  stream_lock();
+  stream_resend();
+  stream_unlock();
+}
+
+double udpstream_resendtimeout(void)
+{
+  double now=monotime();
+  double wait=-1;
+  stream_lock();
+  unsigned int i;
+  for(i=0; i<streamcount; ++i)
+  {
+    if(streams[i]->state&STATE_CLOSED){continue;}
+    unsigned int i2;
+    for(i2=0; i2<streams[i]->sentpacketcount; ++i2)
+    {
+      double due=streams[i]->sentpackets[i2].sent+RESEND_TIMEOUT-now;
+      if(due<0){due=0;}
+      if(wait<0 || due<wait){wait=due;}
+    }
+  }
+  stream_unlock();
+  return wait;
+}
+
+void udpstream_hold(struct udpstream* stream, char held)
+{
+  stream_lock();
+  stream->held=held;
+  stream_unlock();
+}
+
+static void stream_close(struct udpstream* stream)
 {
   if(stream->state&STATE_CLOSED) // Closed by peer, just free it
   {
@@ -396,3 +586,10 @@ void udpstream_close(struct udpstream* stream)
     stream_send(stream, TYPE_CLOSE, 0, 0, 0);
   }
 }
+
+void udpstream_close(struct udpstream* stream)
+{
+  stream_lock();
+  stream_close(stream);
+  stream_unlock();
+}
@@ -46,5 +46,22 @@ extern void udpstream_getaddr(struct udpstream* stream, struct sockaddr_storage*
 
 extern int udpstream_getsocket(struct udpstream* stream);
 
+// Attach application data to a stream (e.g. the connection using it) for quick lookups
+extern void udpstream_setdata(struct udpstream* stream, void* data);
+
+extern void* udpstream_getdata(struct udpstream* stream);
+
+// Number of sent packets not yet acknowledged, for holding back more data while the other end is behind. Packets overdue for resending don't count, so losses can't hold back a stream for good
+extern unsigned int udpstream_unacked(struct udpstream* stream);
+
+// Send packets again that haven't been acknowledged in time, also done by udpstream_poll()
+extern void udpstream_resend(void);
+
+// Seconds until udpstream_resend() has packets to send again, or -1 if nothing is waiting for acknowledgement
+extern double udpstream_resendtimeout(void);
+
+// Keep udpstream_poll() from returning a stream while it's being used elsewhere (e.g. by a worker thread)
+extern void udpstream_hold(struct udpstream* stream, char held);
+
 extern void udpstream_close(struct udpstream* stream);
 #endif
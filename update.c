@@ -21,10 +21,23 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <gnutls/abstract.h>
+#include <gnutls/crypto.h>
 #include "peer.h"
 #include "buffer.h"
+#include "hashtable.h"
 #include "social.h"
 #include "update.h"
+#include "log.h"
+
+#define STORE_VERSION 1 // Format of saved updates, bump when it changes, see social_update_init()
+#define STOREKEY_SIZE 32
+#define STOREMAC_SIZE 32
+#define STOREMAC_FLAG 0x8000000000000000ULL // Set in a saved update's size when a MAC follows it
+#define MAX_RECORD (16*1024*1024)
+
+// Local key vouching for updates in our store having been verified when we got them
+static unsigned char storekey[STOREKEY_SIZE];
+static char storenewer=0; // The store was written by a newer version, leave it alone rather than misread it
 
 static void mkdirp(char* path)
 {
@@ -88,9 +101,127 @@ struct update* social_update_new(struct user* user)
   user->updates[user->updatecount-1].privacy.flags=0;
   user->updates[user->updatecount-1].privacy.circles=0;
   user->updates[user->updatecount-1].privacy.circlecount=0;
+  user->updates[user->updatecount-1].encoded=0;
+  user->updates[user->updatecount-1].encodedsize=0;
+  user->updates[user->updatecount-1].seq=0;
   return &user->updates[user->updatecount-1];
 }
 
+struct seqentry
+{
+  uint64_t seq;
+  uint32_t update; // Index into user->updates, which stay put since updates are never removed
+};
+
+struct seqindex
+{
+  struct seqentry* entries; // Sorted by seq unless dirty
+  unsigned int count;
+  unsigned int size;
+  char dirty; // Something was added out of order, re-sorted on the next lookup by order
+  struct hashtable seqs; // seq -> update index+1
+};
+
+static int seqentry_cmp(const void* a, const void* b)
+{
+  const struct seqentry* x=a;
+  const struct seqentry* y=b;
+  return (x->seq>y->seq)-(x->seq<y->seq);
+}
+
+// First position whose seq is not lower than seq
+static unsigned int seqindex_lowerbound(struct seqindex* index, uint64_t seq)
+{
+  unsigned int low=0;
+  unsigned int high=index->count;
+  while(low<high)
+  {
+    unsigned int mid=low+(high-low)/2;
+    if(index->entries[mid].seq<seq){low=mid+1;}else{high=mid;}
+  }
+  return low;
+}
+
+static void seqindex_append(struct seqindex* index, uint64_t seq, uint32_t update)
+{
+  if(index->count==index->size)
+  {
+    index->size=(index->size?index->size*2:16);
+    index->entries=realloc(index->entries, sizeof(struct seqentry)*index->size);
+  }
+  index->entries[index->count].seq=seq;
+  index->entries[index->count].update=update;
+  ++index->count;
+}
+
+static void seqindex_sort(struct user* user)
+{
+  struct seqindex* index=user->seqindex;
+  index->count=0;
+  unsigned int i;
+  for(i=0; i<user->updatecount; ++i)
+  {
+    if(user->updates[i].seq){seqindex_append(index, user->updates[i].seq, i);}
+  }
+  qsort(index->entries, index->count, sizeof(struct seqentry), seqentry_cmp);
+  index->dirty=0;
+}
+
+void social_update_setseq(struct user* user, struct update* update, uint64_t seq)
+{
+  if(!user->seqindex){user->seqindex=calloc(1, sizeof(struct seqindex));}
+  struct seqindex* index=user->seqindex;
+  uint32_t pos=update-user->updates;
+  if(update->seq)
+  { // Replacing an older version of the update, e.g. a profile field
+    hashtable_remove(&index->seqs, &update->seq, sizeof(update->seq));
+    if(!index->dirty)
+    {
+      unsigned int i=seqindex_lowerbound(index, update->seq);
+      while(i<index->count && index->entries[i].seq==update->seq && index->entries[i].update!=pos){++i;}
+      if(i<index->count && index->entries[i].update==pos)
+      {
+        --index->count;
+        memmove(&index->entries[i], &index->entries[i+1], sizeof(struct seqentry)*(index->count-i));
+      }else{index->dirty=1;}
+    }
+  }
+  update->seq=seq;
+  if(!seq){return;} // Not signed yet
+  hashtable_set(&index->seqs, &seq, sizeof(seq), (void*)(uintptr_t)(pos+1));
+  if(index->dirty){return;}
+  // New updates normally arrive in order, anything else (like loading older rotated files) waits for the next sort
+  if(index->count && index->entries[index->count-1].seq>seq){index->dirty=1; return;}
+  seqindex_append(index, seq, pos);
+}
+
+struct update* social_update_findseq(struct user* user, uint64_t seq)
+{
+  if(!user->seqindex){return 0;}
+  uintptr_t pos=(uintptr_t)hashtable_get(&user->seqindex->seqs, &seq, sizeof(seq));
+  return pos?&user->updates[pos-1]:0;
+}
+
+struct update* social_update_after(struct user* user, uint64_t seq)
+{
+  struct seqindex* index=user->seqindex;
+  if(!index){return 0;}
+  if(index->dirty){seqindex_sort(user);}
+  unsigned int i=seqindex_lowerbound(index, seq);
+  while(i<index->count && index->entries[i].seq<=seq){++i;}
+  return (i<index->count)?&user->updates[index->entries[i].update]:0;
+}
+
+// Keep the encoded form of a signed update, from <sigsize, 4><signature><signed data>
+static void update_setencoded(struct update* update, const unsigned char id[ID_SIZE], const void* data, unsigned int len)
+{
+  free(update->encoded);
+  update->encodedsize=ID_SIZE+len;
+  update->encoded=malloc(update->encodedsize);
+  memcpy(update->encoded, id, ID_SIZE);
+  memcpy(update->encoded+ID_SIZE, data, len);
+}
+
 void social_update_sign(struct update* update)
 {
   struct buffer buf;
@@ -98,44 +229,127 @@ void social_update_sign(struct update* update)
   social_update_write(&buf, update);
   gnutls_datum_t data={.data=buf.buf, .size=buf.size};
   gnutls_datum_t signature;
-  gnutls_privkey_sign_data(peer_privkey, GNUTLS_DIG_SHA256, 0, &data, &signature);
-  buffer_deinit(buf);
+  gnutls_sign_algorithm_t algo=peer_signalgo(gnutls_privkey_get_pk_algorithm(peer_privkey, 0));
+  gnutls_privkey_sign_data2(peer_privkey, algo, 0, &data, &signature);
   update->signaturesize=signature.size;
   void* sigbuf=malloc(signature.size);
   memcpy(sigbuf, signature.data, signature.size);
   gnutls_free(signature.data);
   update->signature=sigbuf;
+  // Signing is always done by us, so we're the author
+  struct buffer signedbuf;
+  buffer_init(signedbuf);
+  buffer_write(signedbuf, &update->signaturesize, sizeof(update->signaturesize));
+  buffer_write(signedbuf, update->signature, update->signaturesize);
+  buffer_write(signedbuf, buf.buf, buf.size);
+  update_setencoded(update, peer_id, signedbuf.buf, signedbuf.size);
+  buffer_deinit(signedbuf);
+  buffer_deinit(buf);
 }
 
-void social_update_save(struct user* user, struct update* update)
+void social_update_init(void)
+{
+  // <store version, 1><key, 32>, the first stores with MACs had just the key
+  char path[strlen(social_prefix)+strlen("/storekey")+1];
+  sprintf(path, "%s/storekey", social_prefix);
+  int f=open(path, O_RDONLY);
+  if(f>=0)
+  {
+    unsigned char buf[1+STOREKEY_SIZE];
+    ssize_t r=read(f, buf, sizeof(buf));
+    close(f);
+    if(r==sizeof(buf) && buf[0]>STORE_VERSION)
+    {
+      LOG(LOGLEVEL_ERROR, "Updates in %s were saved by a newer version (store version %u, we have %u), not loading or saving any", social_prefix, buf[0], STORE_VERSION);
+      storenewer=1;
+      return;
+    }
+    if(r==sizeof(buf)){memcpy(storekey, &buf[1], STOREKEY_SIZE); return;}
+    if(r!=STOREKEY_SIZE){gnutls_rnd(GNUTLS_RND_KEY, storekey, STOREKEY_SIZE);}
+    else{memcpy(storekey, buf, STOREKEY_SIZE);}
+  }else{
+    // New store, or an unusable key which only means updates get verified again as they're loaded
+    gnutls_rnd(GNUTLS_RND_KEY, storekey, STOREKEY_SIZE);
+  }
+  unsigned char version=STORE_VERSION;
+  mkdirp(path);
+  f=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  write(f, &version, sizeof(version));
+  write(f, storekey, STOREKEY_SIZE);
+  close(f);
+}
+
+static void storemac(const unsigned char id[ID_SIZE], const void* data, unsigned int len, unsigned char mac[STOREMAC_SIZE])
+{
+  gnutls_hmac_hd_t hmac;
+  gnutls_hmac_init(&hmac, GNUTLS_MAC_SHA256, storekey, STOREKEY_SIZE);
+  gnutls_hmac(hmac, id, ID_SIZE);
+  gnutls_hmac(hmac, data, len);
+  gnutls_hmac_deinit(hmac, mac);
+}
+
+// Based on update type consider some updates "sticky", e.g. fields, friends, media (just the metadata, hash+name+size)
+// and save them to an alternative, non-rotated updates file
+static char update_sticky(struct update* update)
+{
+  return (update->type==UPDATE_FIELD || update->type==UPDATE_MEDIA || update->type==UPDATE_FRIENDS);
+}
+
+static int update_open(struct user* user, char sticky)
 {
-  // Based on update type consider some updates "sticky", e.g. fields, friends, media (just the metadata, hash+name+size)
-  // and save them to an alternative, non-rotated updates file
-  char sticky=(update->type==UPDATE_FIELD || update->type==UPDATE_MEDIA || update->type==UPDATE_FRIENDS);
   char path[strlen(social_prefix)+strlen("/updates/.sticky0")+ID_SIZE*2];
+  if(storenewer){return -1;}
   sprintf(path, "%s/updates/"PEERFMT"%s", social_prefix, PEERARG(user->id), sticky?".sticky":"");
   mkdirp(path);
-  int f=open(path, O_WRONLY|O_CREAT|O_APPEND, 0600);
-  struct buffer buf;
-  buffer_init(buf);
-  social_update_write(&buf, update);
-  uint64_t size=sizeof(update->signaturesize)+update->signaturesize+buf.size;
-  write(f, &size, sizeof(size));
-  write(f, &update->signaturesize, sizeof(update->signaturesize));
-  write(f, update->signature, update->signaturesize);
-  write(f, buf.buf, buf.size);
-  buffer_deinit(buf);
-  // Check position of f and rotate if it's large (100kb), and non-sticky
+  return open(path, O_WRONLY|O_CREAT|O_APPEND, 0600);
+}
+
+// Append an update to f, returns 1 if f is non-sticky and large enough (100kb) to rotate
+static char update_write(int f, struct update* update, char sticky)
+{
+  // <size, 8><mac, 32><sigsize, 4><signature><signed data>, the encoded update minus the author ID, MAC'd along with the author ID
+  uint64_t size=update->encodedsize-ID_SIZE;
+  uint64_t header=size|STOREMAC_FLAG;
+  unsigned char mac[STOREMAC_SIZE];
+  storemac(update->encoded, update->encoded+ID_SIZE, size, mac);
+  write(f, &header, sizeof(header));
+  write(f, mac, STOREMAC_SIZE);
+  write(f, update->encoded+ID_SIZE, size);
   // TODO: Make the 100kb limit configurable
-  if(!sticky && lseek(f, 0, SEEK_CUR)>100*1024)
+  return !sticky && lseek(f, 0, SEEK_CUR)>100*1024;
+}
+
+void social_update_save(struct user* user, struct update* update)
+{
+  if(!update->encoded){return;} // Not signed yet
+  char sticky=update_sticky(update);
+  int f=update_open(user, sticky);
+  if(update_write(f, update, sticky)){social_update_rotate(user);}
+  close(f);
+}
+
+void social_update_savemany(struct user* user, const uint64_t* seqs, unsigned int count)
+{
+  int files[2]={-1, -1}; // Rotating and sticky, opened once each for the whole group
+  unsigned int i;
+  for(i=0; i<count; ++i)
   {
-    social_update_rotate(user);
+    struct update* update=social_update_findseq(user, seqs[i]);
+    if(!update || !update->encoded){continue;} // Replaced by a later update in the same group
+    int sticky=update_sticky(update);
+    if(files[sticky]<0){files[sticky]=update_open(user, sticky);}
+    if(update_write(files[sticky], update, sticky))
+    { // Rotating renames the file from under us, so the rest goes into a fresh one
+      social_update_rotate(user);
+      close(files[sticky]);
+      files[sticky]=-1;
+    }
   }
-  close(f);
-// TODO: Is it bad to close and reopen a file in rapid succession? if it is maybe we should implement some kind of cache for cases where we're saving many updates fast, like receiving someone else's updates for the first time
+  if(files[0]>=0){close(files[0]);}
+  if(files[1]>=0){close(files[1]);}
 }
 
-struct update* social_update_getfield(struct user* user, const char* name)
+static struct update* update_findfield(struct user* user, const char* name)
 {
   unsigned int i;
   for(i=0; i<user->updatecount; ++i)
@@ -143,16 +357,22 @@ struct update* social_update_getfield(struct user* user, const char* name)
     if(user->updates[i].type!=UPDATE_FIELD){continue;}
     if(!strcmp(user->updates[i].field.name, name)){return &user->updates[i];}
   }
-  struct update* ret=social_update_new(user);
+  return 0;
+}
+
+struct update* social_update_getfield(struct user* user, const char* name)
+{
+  struct update* ret=update_findfield(user, name);
+  if(ret){return ret;}
+  ret=social_update_new(user);
   ret->type=UPDATE_FIELD;
-  ret->seq=0;
   ret->signature=0;
   ret->field.name=strdup(name);
   ret->field.value=0;
   return ret;
 }
 
-struct update* social_update_getfriend(struct user* user, uint32_t circle, const unsigned char id[ID_SIZE])
+static struct update* update_findfriend(struct user* user, uint32_t circle, const unsigned char id[ID_SIZE])
 {
   unsigned int i;
   for(i=0; i<user->updatecount; ++i)
@@ -161,9 +381,15 @@ struct update* social_update_getfriend(struct user* user, uint32_t circle, const
     if(user->updates[i].friends.circle!=circle){continue;}
     if(!memcmp(user->updates[i].friends.id, id, ID_SIZE)){return &user->updates[i];}
   }
-  struct update* ret=social_update_new(user);
+  return 0;
+}
+
+struct update* social_update_getfriend(struct user* user, uint32_t circle, const unsigned char id[ID_SIZE])
+{
+  struct update* ret=update_findfriend(user, circle, id);
+  if(ret){return ret;}
+  ret=social_update_new(user);
   ret->type=UPDATE_FRIENDS;
-  ret->seq=0;
   ret->signature=0;
   ret->friends.circle=circle;
   memcpy(ret->friends.id, id, ID_SIZE);
@@ -180,7 +406,6 @@ struct update* social_update_getcircle(struct user* user, uint32_t circle)
   }
   struct update* ret=social_update_new(user);
   ret->type=UPDATE_CIRCLE;
-  ret->seq=0;
   ret->signature=0;
   ret->circle.circle=circle;
   ret->circle.name=0;
@@ -195,9 +420,115 @@ struct update* social_update_getcircle(struct user* user, uint32_t circle)
   if(datalen<buflen){return 0;} \
   memcpy(buf, data, buflen); \
   advance(data, datalen, buflen)
-struct update* social_update_parse(struct user* user, void* data, unsigned int len) // Both for receiving updates and loading them from file
+char social_update_verify(struct user* user, const void* data, unsigned int len)
+{
+  // <sigsize, 4><signature><signed data>
+  if(!user->pubkey){return 0;} // Don't have their public key to verify yet
+  uint32_t signaturesize;
+  if(len<sizeof(signaturesize)){return 0;}
+  memcpy(&signaturesize, data, sizeof(signaturesize));
+  if(len-sizeof(signaturesize)<signaturesize){return 0;}
+  gnutls_datum_t verifysig={.data=(unsigned char*)data+sizeof(signaturesize), .size=signaturesize};
+  gnutls_datum_t verifydata={.data=verifysig.data+signaturesize, .size=len-sizeof(signaturesize)-signaturesize};
+  gnutls_sign_algorithm_t algo=peer_signalgo(gnutls_pubkey_get_pk_algorithm(user->pubkey, 0));
+  return gnutls_pubkey_verify_data2(user->pubkey, algo, 0, &verifydata, &verifysig)>=0;
+}
+
+// Read an update's sequence number and type, and for fields and friends skip ahead to what the update would replace
+static char update_peek(const unsigned char** buf, unsigned int* buflen, uint64_t* seq, uint8_t* type)
+{
+  // <sigsize, 4><signature><seq, 8><type, 1><timestamp, 8><privacy flags, 1><circlecount, 4><circles><placeholder, 4><type-specific data>
+  const unsigned char* data=*buf;
+  unsigned int len=*buflen;
+  uint32_t signaturesize;
+  readbin(data, len, &signaturesize, sizeof(signaturesize));
+  if(len<signaturesize){return 0;}
+  advance(data, len, signaturesize);
+  readbin(data, len, seq, sizeof(*seq));
+  readbin(data, len, type, sizeof(*type));
+  if(*type==UPDATE_FIELD || *type==UPDATE_FRIENDS)
+  {
+    // Skip past timestamp and privacy
+    uint8_t flags;
+    uint32_t circlecount;
+    if(len<sizeof(uint64_t)){return 0;}
+    advance(data, len, sizeof(uint64_t));
+    readbin(data, len, &flags, sizeof(flags));
+    readbin(data, len, &circlecount, sizeof(circlecount));
+    if(len/sizeof(uint32_t)<circlecount+1){return 0;}
+    advance(data, len, sizeof(uint32_t)*(circlecount+1));
+  }
+  *buf=data;
+  *buflen=len;
+  return 1;
+}
+
+char social_update_precheck(struct user* user, const void* buf, unsigned int len)
+{
+  const unsigned char* data=buf;
+  uint64_t seq;
+  uint8_t type;
+  if(!update_peek(&data, &len, &seq, &type)){return 0;}
+  if(social_update_findseq(user, seq)){++social_stats.verificationsavoided; return 0;} // Already have it
+  if(type!=UPDATE_FIELD && type!=UPDATE_FRIENDS){return 1;}
+  struct update* update;
+  if(type==UPDATE_FIELD)
+  {
+    uint32_t namelen;
+    readbin(data, len, &namelen, sizeof(namelen));
+    if(len<namelen){return 0;}
+    char name[namelen+1];
+    readbin(data, len, name, namelen);
+    name[namelen]=0;
+    update=update_findfield(user, name);
+  }else{
+    uint32_t circle;
+    char add;
+    unsigned char id[ID_SIZE];
+    readbin(data, len, &circle, sizeof(circle));
+    readbin(data, len, &add, sizeof(add));
+    readbin(data, len, id, ID_SIZE);
+    update=update_findfriend(user, circle, id);
+  }
+  if(update && update->seq>seq){++social_stats.verificationsavoided; return 0;} // Superseded
+  return 1;
+}
+
+char social_update_key(const void* buf, unsigned int len, uint64_t* seq, struct buffer* key)
+{
+  const unsigned char* data=buf;
+  uint8_t type;
+  key->size=0;
+  if(!update_peek(&data, &len, seq, &type)){return 0;}
+  if(type==UPDATE_FIELD)
+  {
+    uint32_t namelen;
+    readbin(data, len, &namelen, sizeof(namelen));
+    if(len<namelen){return 0;}
+    buffer_write(*key, &type, sizeof(type));
+    buffer_write(*key, data, namelen);
+  }
+  else if(type==UPDATE_FRIENDS)
+  {
+    uint32_t circle;
+    char add;
+    readbin(data, len, &circle, sizeof(circle));
+    readbin(data, len, &add, sizeof(add));
+    if(len<ID_SIZE){return 0;}
+    buffer_write(*key, &type, sizeof(type));
+    buffer_write(*key, &circle, sizeof(circle));
+    buffer_write(*key, data, ID_SIZE);
+  }
+  return 1;
+}
+
+static struct update* update_parse(struct user* user, void* data, unsigned int len, char verified)
 {
   // <sigsize, 4><signature><seq, 8><type, 1><timestamp, 8><type-specific data>
+  // 1. Verify signature, unless the cheaper checks already tell us we don't need it
+  if(!verified && (!social_update_precheck(user, data, len) || !social_update_verify(user, data, len))){return 0;}
+  void* encoded=data;
+  unsigned int encodedlen=len;
   uint32_t signaturesize;
   uint64_t seq;
   uint8_t type;
@@ -205,11 +536,6 @@ struct update* social_update_parse(struct user* user, void* data, unsigned int l
   readbin(data, len, &signaturesize, sizeof(signaturesize));
   unsigned char signature[signaturesize];
   readbin(data, len, signature, signaturesize);
-  if(!user->pubkey){return 0;} // Don't have their public key to verify yet
-  // 1. Verify signature
-  gnutls_datum_t verifydata={.data=data, .size=len};
-  gnutls_datum_t verifysig={.data=signature, .size=signaturesize};
-  if(gnutls_pubkey_verify_data2(user->pubkey, GNUTLS_SIGN_RSA_SHA256, 0, &verifydata, &verifysig)<0){return 0;} // Forgery
   readbin(data, len, &seq, sizeof(seq));
   readbin(data, len, &type, sizeof(type));
   readbin(data, len, &timestamp, sizeof(timestamp));
@@ -225,11 +551,7 @@ struct update* social_update_parse(struct user* user, void* data, unsigned int l
   readbin(data, len, &privplaceholder, sizeof(privplaceholder));
   // 2. Check sequence number uniqueness
   // NOTE: If instead of checking uniqueness we just checked if seq was higher than the user's previous seq: When relaying updates to a friend's friend a malicious peer could skip some entries, but pass along a more recent one, to effectively censor the earlier entries even when the author themself sends them at a later time. Hopefully it'll be enough that we probably get updates from multiple sources, so if one skips stuff we'll still get filled in by someone else
-  unsigned int i;
-  for(i=0; i<user->updatecount; ++i)
-  {
-    if(user->updates[i].seq==seq){return 0;} // Old update
-  }
+  if(social_update_findseq(user, seq)){return 0;} // Old update
 // TODO: To avoid an accidental form of the above when a friend's friend is in different circles and doesn't get the same updates, only update seq when we get the update directly from user or when seq==user->seq+1
   if(user->seq<seq){user->seq=seq;} // Update user's sequence
   // 3. Add to list of updates, replacing any old entry for the same data when applicable (e.g. updating profile fields, but not posts)
@@ -281,14 +603,14 @@ struct update* social_update_parse(struct user* user, void* data, unsigned int l
     readbin(data, len, &circle, sizeof(circle));
     readbin(data, len, &add, sizeof(add));
     readbin(data, len, id, ID_SIZE);
+    update=social_update_getfriend(user, circle, id);
+    if(update->seq>seq){return 0;} // Old version
     if(add)
     {
       social_user_addtocircle(user, circle, id);
     }else{
       social_user_removefromcircle(user, circle, id);
     }
-    update=social_update_getfriend(user, circle, id);
-    if(update->seq>seq){return 0;} // Old version
     update->friends.add=add;
     }
     break;
@@ -323,13 +645,63 @@ struct update* social_update_parse(struct user* user, void* data, unsigned int l
   memcpy(sigbuf, signature, signaturesize);
   update->signaturesize=signaturesize;
   update->signature=sigbuf;
-  update->seq=seq;
+  social_update_setseq(user, update, seq);
   update->type=type;
   update->timestamp=timestamp;
   privcpy(update->privacy, privacy);
+  update_setencoded(update, user->id, encoded, encodedlen);
   return update;
 }
 
+struct update* social_update_parse(struct user* user, void* data, unsigned int len) // Both for receiving updates and loading them from file
+{
+  return update_parse(user, data, len, 0);
+}
+
+unsigned char* social_update_read(struct user* user, int f, unsigned int* len, char* trusted)
+{
+  // <size, 8>[<mac, 32>]<sigsize, 4><signature><signed data>, older records have no MAC
+  uint64_t size;
+  if(storenewer || read(f, &size, sizeof(size))!=sizeof(size)){return 0;}
+  char hasmac=!!(size&STOREMAC_FLAG);
+  size&=~STOREMAC_FLAG;
+  unsigned char mac[STOREMAC_SIZE];
+  if(hasmac && read(f, mac, STOREMAC_SIZE)!=STOREMAC_SIZE){return 0;}
+  if(size>MAX_RECORD){return 0;} // Corrupt
+  unsigned char* buf=malloc(size);
+  if(read(f, buf, size)!=(ssize_t)size){free(buf); return 0;}
+  *trusted=0;
+  if(hasmac)
+  {
+    unsigned char expected[STOREMAC_SIZE];
+    storemac(user->id, buf, size, expected);
+    *trusted=!memcmp(mac, expected, STOREMAC_SIZE);
+  }
+  *len=size;
+  return buf;
+}
+
+char social_update_load(struct user* user, int f)
+{
+  unsigned int len;
+  char trusted;
+  unsigned char* buf=social_update_read(user, f, &len, &trusted);
+  if(!buf){return 0;}
+  if(trusted)
+  { // We verified it before saving it, see social_audit() to check anyway
+    if(update_parse(user, buf, len, 1)){++social_stats.trustedloads;}
+  }else{
+    update_parse(user, buf, len, 0);
+  }
+  free(buf);
+  return 1;
+}
+
+struct update* social_update_apply(struct user* user, void* data, unsigned int len)
+{
+  return update_parse(user, data, len, 1);
+}
+
 void social_update_rotate(struct user* user)
 {
   unsigned int i;
@@ -37,6 +37,8 @@ struct update
 {
   const char* signature;
   uint32_t signaturesize;
+  unsigned char* encoded; // Signed update as sent in "updateinfo": <author ID><signature size><signature><update>, kept so it doesn't need to be serialized again
+  uint32_t encodedsize;
   uint64_t seq; // Sequence of this update
   uint8_t type;
   uint64_t timestamp;
@@ -73,15 +75,99 @@ struct update
     } circle;
   };
 };
+// Load or create the key authenticating the local update store, called by social_init()
+// The store's format version is kept along with it. Builds from before the version was recorded can't read stores written since, so downgrading isn't possible, and a store from a newer version is left alone
+extern void social_update_init(void);
 extern void social_update_write(struct buffer* buf, struct update* update);
 extern struct update* social_update_new(struct user* user);
 extern void social_update_sign(struct update* update);
 extern void social_update_save(struct user* user, struct update* update);
+/**
+* social_update_savemany:
+* @user: User the updates belong to
+* @seqs: Sequence numbers of the updates to save, in order
+* @count: Number of updates
+*
+* Save a group of updates, like social_update_save() but opening each file only once. Updates are passed by sequence number since applying them may have moved them around
+*/
+extern void social_update_savemany(struct user* user, const uint64_t* seqs, unsigned int count);
 extern struct update* social_update_getfield(struct user* user, const char* name);
 extern struct update* social_update_getfriend(struct user* user, uint32_t circle, const unsigned char id[ID_SIZE]);
 extern struct update* social_update_getcircle(struct user* user, uint32_t circle);
+/**
+* social_update_setseq:
+* @user: User the update belongs to
+* @update: Update
+* @seq: New sequence number, or 0 for an update that isn't signed yet
+*
+* Set an update's sequence number, keeping the user's index of updates by sequence up to date
+*/
+extern void social_update_setseq(struct user* user, struct update* update, uint64_t seq);
+/**
+* social_update_findseq:
+* @user: User
+* @seq: Sequence number
+*
+* Look up an update by its sequence number in constant time
+* Returns: The update, or NULL if we don't have it
+*/
+extern struct update* social_update_findseq(struct user* user, uint64_t seq);
+/**
+* social_update_after:
+* @user: User
+* @seq: Sequence number
+*
+* Find the next update in sequence order, for walking through updates newer than what someone already has
+* Returns: The update with the lowest sequence number above @seq, or NULL if there is none
+*/
+extern struct update* social_update_after(struct user* user, uint64_t seq);
 extern struct update* social_update_parse(struct user* user, void* data, unsigned int len); // Both for receiving updates and loading them from file
 /**
+* social_update_precheck:
+* @user: Author of the update
+* @data: Signed update, <sigsize, 4><signature><signed data>
+* @len: Length of @data
+*
+* Cheap checks to do before verifying an update's signature: rejects updates we already have, or have a newer version of, without any public key operations
+* Returns: 1 if the update may be new and is worth verifying, otherwise 0
+*/
+extern char social_update_precheck(struct user* user, const void* data, unsigned int len);
+/**
+* social_update_key:
+* @data: Signed update, <sigsize, 4><signature><signed data>
+* @len: Length of @data
+* @seq: Where to store the update's sequence number
+* @key: Buffer for what the update replaces (a field's name, or a circle and friend ID), left empty for updates that don't replace anything
+*
+* Get what social_update_precheck() looks at, for weeding out duplicate and superseded updates among ones that haven't been applied yet. Doesn't touch any user
+* Returns: 1 on success, 0 if the update is malformed
+*/
+extern char social_update_key(const void* data, unsigned int len, uint64_t* seq, struct buffer* key);
+// Check just the signature, safe to call from worker threads once the user's public key is set
+extern char social_update_verify(struct user* user, const void* data, unsigned int len);
+// Like social_update_parse() for updates that already passed social_update_verify()
+extern struct update* social_update_apply(struct user* user, void* data, unsigned int len);
+/**
+* social_update_load:
+* @user: User whose updates file is being read
+* @f: File descriptor of the updates file
+*
+* Read the next update saved by social_update_save(). Updates carrying a valid MAC from our local store key were verified when we got them and are applied without verifying their signatures again, others are parsed like received updates
+* Returns: 1 if a record was read, 0 at the end of the file or if the record is truncated or too large
+*/
+extern char social_update_load(struct user* user, int f);
+/**
+* social_update_read:
+* @user: User whose updates file is being read
+* @f: File descriptor of the updates file
+* @len: Where to store the length of the update
+* @trusted: Set to 1 if the update carries a valid MAC from our local store key, meaning it was verified when we got it
+*
+* Read the next update saved by social_update_save() without applying it, for loading on worker threads. Only reads @user's ID
+* Returns: The signed update, <sigsize, 4><signature><signed data>, to be freed by the caller, or NULL at the end of the file or if the record is truncated or too large
+*/
+extern unsigned char* social_update_read(struct user* user, int f, unsigned int* len, char* trusted);
+/**
 * social_update_rotate:
 * @user: User to rotate updates for
 *
@@ -0,0 +1,102 @@
+/*
+    Socialnetwork, a truly peer-to-peer social network (in search of a better name)
+    Copyright (C) 2017  alicia@ion.nu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "social.h"
+#include "update.h"
+
+// Compare looking up updates by sequence number through the index against scanning every update, for a user with lots of updates
+#define UPDATES 1000000
+#define LOOKUPS 1000
+
+static double elapsed(struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-start->tv_sec)+(now.tv_nsec-start->tv_nsec)/1000000000.0;
+}
+
+static void addupdates(struct user* user, uint64_t first, uint64_t last)
+{
+  uint64_t seq;
+  for(seq=first; seq<=last; ++seq)
+  {
+    struct update* update=social_update_new(user);
+    update->type=UPDATE_POST;
+    update->post.message=0;
+    social_update_setseq(user, update, seq);
+  }
+}
+
+int main(void)
+{
+  struct user* user=calloc(1, sizeof(struct user));
+  struct timespec start;
+  // Newest half first, then older ones the way social_user_loadmore() would load rotated files
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  addupdates(user, UPDATES/2+1, UPDATES);
+  addupdates(user, 1, UPDATES/2);
+  printf("Adding %u updates: %.2fms\n", UPDATES, elapsed(&start)*1000);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  social_update_after(user, 0);
+  printf("Sorting after out of order loading: %.2fms\n", elapsed(&start)*1000);
+  // Duplicate checks
+  unsigned int i;
+  unsigned int found=0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(i=0; i<LOOKUPS; ++i)
+  {
+    uint64_t seq=rand()%(UPDATES*2)+1;
+    unsigned int j;
+    for(j=0; j<user->updatecount; ++j)
+    {
+      if(user->updates[j].seq==seq){++found; break;}
+    }
+  }
+  double scan=elapsed(&start);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(i=0; i<LOOKUPS; ++i)
+  {
+    uint64_t seq=rand()%(UPDATES*2)+1;
+    if(social_update_findseq(user, seq)){++found;}
+  }
+  double indexed=elapsed(&start);
+  printf("Duplicate check: scan %10.3fus, index %10.3fus\n", scan*1000000/LOOKUPS, indexed*1000000/LOOKUPS);
+  // Catching up on the last 100 updates, as in "getupdates"
+  unsigned int sent=0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(i=0; i<LOOKUPS; ++i)
+  {
+    unsigned int j;
+    for(j=0; j<user->updatecount; ++j)
+    {
+      if(user->updates[j].seq<=UPDATES-100){continue;}
+      ++sent;
+    }
+  }
+  scan=elapsed(&start);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(i=0; i<LOOKUPS; ++i)
+  {
+    struct update* update;
+    for(update=social_update_after(user, UPDATES-100); update; update=social_update_after(user, update->seq)){++sent;}
+  }
+  indexed=elapsed(&start);
+  printf("Range of 100:    scan %10.3fus, index %10.3fus\n", scan*1000000/LOOKUPS, indexed*1000000/LOOKUPS);
+  return (found+sent)?0:1;
+}